@@ -58,7 +58,7 @@ struct __attribute__((__packed__)) trg_ctrl {
  @endcode
  */
 #define GET_VERSION	_IOR(AMC_PICO_MAGIC, 10, uint32_t)
-#define GET_VERSION_CURRENT 3
+#define GET_VERSION_CURRENT 4
 
 /** Sets the picoammeter range, each bit sets the individual channel,
  * RNG0 is the higher current range
@@ -100,4 +100,245 @@ struct __attribute__((__packed__)) trg_ctrl {
 #define GET_SITE_VERSION _IOR(AMC_PICO_MAGIC, 92, uint32_t)
 #define SET_SITE_MODE _IOW(AMC_PICO_MAGIC, 92, uint32_t)
 
+/** USER_SITE_FRIB site mode where each read() returns one or more
+ * whole capture events, each a struct pico_frib_event followed by
+ * 'length' bytes of capture registers.
+ */
+#define FRIB_SITE_MODE_EVENTS 3
+
+struct pico_frib_event {
+    uint32_t seq;    /* event counter, including lost events */
+    uint32_t lost;   /* events lost just before this one */
+    uint32_t status; /* USER_STATUS when captured */
+    uint32_t length; /* bytes of capture registers which follow */
+};
+
+/** Operations for struct pico_reg_op */
+#define PICO_REG_READ  0 /* value = reg */
+#define PICO_REG_WRITE 1 /* reg = value */
+#define PICO_REG_RMW   2 /* reg = (reg&~mask)|(value&mask), value = new reg */
+#define PICO_REG_POLL  3 /* wait until (reg&mask)==(value&mask), value = last reg */
+
+struct pico_reg_op {
+    uint32_t offset; /* in BAR0, multiple of 4 */
+    uint32_t op;     /* PICO_REG_* */
+    uint32_t mask;
+    uint32_t value;
+};
+
+/** Maximum pico_reg_batch::count */
+#define PICO_REG_BATCH_MAX 256
+
+struct pico_reg_batch {
+    uint64_t ops;        /* address of struct pico_reg_op[count] */
+    uint32_t count;      /* in: number of ops, out: number completed */
+    uint32_t timeout_us; /* limit for each PICO_REG_POLL */
+};
+
+/** USER_SITE_FRIB site mode 1 (register access) only.
+ * Run a list of register operations in order, in one call.
+ * All offsets are checked before any are run.
+ * Stops at the first failure (eg. ETIMEDOUT from PICO_REG_POLL)
+ * with results of the completed ops stored.
+ */
+#define FRIB_REG_BATCH _IOWR(AMC_PICO_MAGIC, 111, struct pico_reg_batch)
+
+/** read() modes for SET_READ_MODE */
+#define READ_MODE_ONESHOT 0
+#define READ_MODE_STREAM  1
+#define READ_MODE_DIRECT  2
+#define READ_MODE_SHARED  3
+
+/** Select how read() acquires data on this FD.
+ * READ_MODE_ONESHOT (default) arms the card for each read().
+ * READ_MODE_STREAM keeps all DMA buffers cycling so that successive
+ * read()s return gapless data.  Only one FD per card may stream.
+ * READ_MODE_DIRECT arms the card for each read(), which DMAs directly
+ * into the caller's buffer.
+ * READ_MODE_SHARED FDs all receive a copy of each acquisition.
+ * read() returns the next acquisition not yet seen by this FD,
+ * arming the card if it is idle.  See GET_SHARED_INFO.
+ */
+#define SET_READ_MODE _IOW(AMC_PICO_MAGIC, 100, uint32_t)
+
+/** Number of times the stream stalled because all DMA buffers were full */
+#define GET_STREAM_OVERRUNS _IOR(AMC_PICO_MAGIC, 101, uint32_t)
+
+/** Number and size of DMA buffers.
+ * Buffer N may be mmap()'d read-only at offset N*length.
+ */
+struct pico_dma_info {
+    uint32_t count;
+    uint32_t length;
+};
+
+#define GET_DMA_BUF_INFO _IOR(AMC_PICO_MAGIC, 102, struct pico_dma_info)
+
+/** A completed DMA buffer, valid bytes are [offset, offset+length) */
+struct pico_dma_buf {
+    uint32_t index;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t seq;
+};
+
+/** Wait for the next completed buffer in READ_MODE_STREAM.
+ * The buffer is not re-used by the DMA engine until handed back with DMA_QBUF.
+ * Fails with ENOBUFS when all buffers are held.
+ */
+#define DMA_DQBUF _IOR(AMC_PICO_MAGIC, 103, struct pico_dma_buf)
+
+/** Hand back a buffer index from DMA_DQBUF.  Must be in dequeue order. */
+#define DMA_QBUF _IOW(AMC_PICO_MAGIC, 104, uint32_t)
+
+/** Arm for acquisition without waiting.
+ * In READ_MODE_ONESHOT the argument is the number of bytes to acquire.
+ * In READ_MODE_STREAM the stream is started and the argument is ignored.
+ * Wait for completion with poll() or read().
+ */
+#define ARM_READ _IOW(AMC_PICO_MAGIC, 105, uint32_t)
+
+/** User buffer for READ_MODE_DIRECT */
+struct pico_user_buf {
+    uint64_t addr;
+    uint64_t length;
+};
+
+/** Pin a user buffer for READ_MODE_DIRECT, to be re-used by many read()s.
+ * read()s entirely within this buffer skip pinning pages.
+ * One buffer per FD.
+ */
+#define MAP_USER_BUF _IOW(AMC_PICO_MAGIC, 106, struct pico_user_buf)
+
+/** Release the buffer from MAP_USER_BUF */
+#define UNMAP_USER_BUF _IO(AMC_PICO_MAGIC, 107)
+
+/** DDR char. dev. only.
+ * Select the DDR page (window of BAR2 size) and keep it selected
+ * for this FD until DDR_UNLOCK_PAGE or close().  Other FDs get EBUSY.
+ * Required to mmap() the DDR char. dev., which maps the selected page.
+ * May be repeated to switch pages.
+ */
+#define DDR_LOCK_PAGE _IOW(AMC_PICO_MAGIC, 109, uint32_t)
+
+/** DDR char. dev. only.  Release the page from DDR_LOCK_PAGE.
+ * EBUSY while still mmap()'d.
+ */
+#define DDR_UNLOCK_PAGE _IO(AMC_PICO_MAGIC, 110)
+
+/** Re-read the configuration registers returned by GET_RANGE, GET_FSAMP, etc.
+ * from hardware, and forget the DDR page last selected.
+ * Only needed if they were changed other than by this driver.
+ */
+#define RESYNC_REGS _IO(AMC_PICO_MAGIC, 112)
+
+#define PICO_ACQ_CONFIG_VERSION 1
+
+/** pico_acq_config::mask bits */
+#define PICO_CFG_RANGE    0x01
+#define PICO_CFG_FSAMP    0x02
+#define PICO_CFG_TRG      0x04 /* all trg_* */
+#define PICO_CFG_RING_BUF 0x08
+#define PICO_CFG_GATE_MUX 0x10
+#define PICO_CFG_CONV_MUX 0x20
+#define PICO_CFG_ALL      0x3f
+
+/** All acquisition settings, as the individual SET_* ioctl()s */
+struct pico_acq_config {
+    uint32_t version;     /* PICO_ACQ_CONFIG_VERSION */
+    uint32_t mask;        /* PICO_CFG_* fields to change */
+    uint32_t range;       /* SET_RANGE */
+    uint32_t fsamp;       /* SET_FSAMP, in Hz */
+    float    trg_limit;   /* SET_TRG */
+    uint32_t trg_nr_samp;
+    uint32_t trg_ch_sel;
+    uint32_t trg_mode;    /* enum mode_t */
+    uint32_t ring_buf;    /* SET_RING_BUF */
+    uint32_t gate_mux;    /* SET_GATE_MUX */
+    uint32_t conv_mux;    /* SET_CONV_MUX */
+    uint32_t reserved;    /* must be zero */
+};
+
+/** Change the fields selected by 'mask' together.
+ * All fields are checked first, and nothing is changed if any is invalid.
+ * EBUSY while an acquisition is in progress.
+ * All fields are then overwritten with the current settings,
+ * so mask==0 reads all settings.
+ */
+#define SET_ACQ_CONFIG _IOWR(AMC_PICO_MAGIC, 113, struct pico_acq_config)
+
+/** READ_MODE_SHARED position of this FD */
+struct pico_shared_info {
+    uint32_t seq;    /* acquisition last read() */
+    uint32_t missed; /* acquisitions completed but not read() by this FD */
+};
+
+#define GET_SHARED_INFO _IOR(AMC_PICO_MAGIC, 114, struct pico_shared_info)
+
+/** Read-only status page, mmap() of PAGE_SIZE at PICO_STATUS_MMAP_OFFSET.
+ * Updated by the driver after each interrupt.  To read a consistent copy:
+ @code
+  uint32_t s;
+  struct pico_status copy;
+  do {
+      s = status->seq;  // odd while being updated
+      __sync_synchronize();
+      copy = *status;
+      __sync_synchronize();
+  } while((s&1) || s!=status->seq);
+ @endcode
+ */
+struct pico_status {
+    uint32_t seq;          /* incremented before and after each update */
+    uint32_t dma_done;     /* number of DMA_DONE interrupts with data (not acquisitions) */
+    uint64_t done_ns;      /* CLOCK_MONOTONIC ns of last DMA_DONE */
+    uint32_t bytes_trans;  /* bytes in last DMA_DONE (cf. GET_B_TRANS) */
+    uint32_t num_isr;      /* as sysfs num_isr */
+    uint64_t last_isr;     /* as sysfs last_isr, in CPU cycles */
+    uint64_t longest_isr;  /* as sysfs longest_isr, in CPU cycles */
+    /* as struct pico_stats */
+    uint64_t aborts;
+    uint64_t fifo_runaway;
+    uint64_t empty_done;
+    uint64_t short_xfer;
+    uint64_t acq_seq;      /* acquisition of the last DMA_DONE (cf. pico_read_header seq) */
+};
+
+#define PICO_STATUS_MMAP_OFFSET 0x40000000
+
+#define PICO_READ_HEADER_MAGIC 0x50494348
+
+/** Prefix of each read() with SET_READ_HEADER */
+struct pico_read_header {
+    uint32_t magic;        /* PICO_READ_HEADER_MAGIC */
+    uint32_t size;         /* sizeof(struct pico_read_header) */
+    uint64_t seq;          /* acquisition number on this board */
+    uint64_t arm_ns;       /* CLOCK_MONOTONIC ns when armed */
+    uint64_t done_ns;      /* CLOCK_MONOTONIC ns of the last DMA_DONE interrupt */
+    uint32_t bytes;        /* bytes actually transferred by DMA */
+    uint32_t reserved;
+    struct pico_acq_config config; /* settings when armed, mask==0 */
+};
+
+/** With a non-zero argument, each READ_MODE_ONESHOT or READ_MODE_SHARED
+ * read() on this FD starts with a struct pico_read_header, followed by data.
+ * The return value includes the header.
+ * read() fails with EINVAL in other modes.
+ */
+#define SET_READ_HEADER _IOW(AMC_PICO_MAGIC, 115, uint32_t)
+
+/** Cumulative counters since the driver was loaded */
+struct pico_stats {
+    uint64_t bytes;        /* bytes transferred by DMA */
+    uint64_t reads;        /* successful read()s */
+    uint64_t aborts;       /* ABORT_READ ioctl()s */
+    uint64_t cancelled;    /* read()s which failed with ECANCELED */
+    uint64_t fifo_runaway; /* DMA response FIFO didn't empty */
+    uint64_t empty_done;   /* DMA_DONE with empty response FIFO */
+    uint64_t short_xfer;   /* DMA commands stopped early by hardware */
+};
+
+/** Snapshot of struct pico_stats */
+#define GET_STATS _IOR(AMC_PICO_MAGIC, 108, struct pico_stats)
+
 #endif /* AMC_PICO_H_ */
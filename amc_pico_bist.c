@@ -23,81 +23,282 @@
 
 #include "amc_pico_bist.h"
 
-/* time measurement */
-static ktime_t t0;
-static ktime_t t1;
+/* repetitions of each point */
+#define BIST_REPEAT 5
+/* pattern written before each transfer to detect words not written by DMA */
+#define BIST_POISON 0xf0f0f0f0
 
+/* smallest transfer size tested */
+#define BIST_MIN_SIZE (64*1024)
 
-int BIST(struct pci_dev *dev)
+/* words used to find the PRBS recurrence, which may be of degree up to half this */
+#define BIST_PRBS_WORDS 128
+/* lowest degree accepted as a PRBS (PRBS7) */
+#define BIST_PRBS_MIN 7
+
+static
+int bist_done(struct board_data *board)
 {
-	const int buf_size = 4*1024*1024;
-	struct board_data *board = NULL;
-	void *tmp_buf = NULL;
-	dma_addr_t tmp_buf_dma;
-	uint32_t mux_tmp;
-	uint64_t time_needed, throughput;
+	return ACCESS_ONCE(board->dma_irq_flag)==2
+		|| ACCESS_ONCE(board->dma_completed)==ACCESS_ONCE(board->dma_pushed);
+}
+
+/* Wait up to 1 second for all pushed commands to complete */
+static
+int bist_wait(struct board_data *board)
+{
+	unsigned long end = jiffies + msecs_to_jiffies(1000);
+	long rc;
+
+	do {
+		long tmo = (long)(end-jiffies);
+		if(tmo<=0)
+			break;
+		if(board->irqmode==dmac_irq_poll) {
+			/* check again after at most one jiffy */
+			amc_isr(board->pci_dev->irq, board);
+			tmo = 1;
+		}
+		rc = wait_event_interruptible_timeout(board->dma_queue, bist_done(board), tmo);
+		if(rc<0)
+			return rc;
+	} while(!bist_done(board));
+
+	if(!bist_done(board))
+		return -ETIMEDOUT;
+	return ACCESS_ONCE(board->dma_irq_flag)==2 ? -ECANCELED : 0;
+}
+
+/* Find the shortest linear recurrence over GF(2) of bit 0 of the first
+ * BIST_PRBS_WORDS words (Berlekamp-Massey).  On return taps[0..ntaps)
+ * are the j for which bit(k) = XOR of bit(k-j).
+ * Returns the degree of the recurrence.
+ */
+static
+unsigned bist_prbs_find(const uint32_t *buf, unsigned char *taps, unsigned *ntaps)
+{
+	unsigned char C[BIST_PRBS_WORDS+1] = {1}, B[BIST_PRBS_WORDS+1] = {1}, T[BIST_PRBS_WORDS+1];
+	unsigned L = 0, m = 1, k, j;
+
+	for(k=0; k<BIST_PRBS_WORDS; k++) {
+		unsigned d = buf[k]&1;
+
+		for(j=1; j<=L; j++)
+			d ^= C[j] & buf[k-j] & 1;
+
+		if(!d) {
+			m++;
+		} else if(2*L<=k) {
+			memcpy(T, C, sizeof(T));
+			for(j=0; j+m<=BIST_PRBS_WORDS; j++)
+				C[j+m] ^= B[j];
+			L = k+1-L;
+			memcpy(B, T, sizeof(B));
+			m = 1;
+		} else {
+			for(j=0; j+m<=BIST_PRBS_WORDS; j++)
+				C[j+m] ^= B[j];
+			m++;
+		}
+	}
+
+	*ntaps = 0;
+	for(j=1; j<=L && j<=BIST_PRBS_WORDS/2; j++) {
+		if(C[j])
+			taps[(*ntaps)++] = j;
+	}
+	return L;
+}
+
+/* Check that a chunk was completely written with non-degenerate data,
+ * and that it is a PRBS.  The polynomial, and how the generator fills
+ * each word, aren't known here.  However every bit of the words from
+ * an LFSR follows the same recurrence, so that found for bit 0 must
+ * hold for whole words through the chunk.
+ */
+static
+int bist_check(const uint32_t *buf, size_t len)
+{
+	unsigned char taps[BIST_PRBS_WORDS/2];
+	size_t i, n = len/4, npoison = 0, nsame = 0;
+	unsigned L, ntaps, j;
+
+	for(i=0; i<n; i++) {
+		if(buf[i]==BIST_POISON)
+			npoison++;
+		if(i && buf[i]==buf[i-1])
+			nsame++;
+	}
+
+	/* allow chance occurrences, but not runs */
+	if(npoison > n/1024 || buf[n-1]==BIST_POISON)
+		return -EIO;
+	if(nsame > n/2)
+		return -EIO;
+
+	if(n < 2*BIST_PRBS_WORDS)
+		return 0;
+	L = bist_prbs_find(buf, taps, &ntaps);
+	if(L<BIST_PRBS_MIN || L>BIST_PRBS_WORDS/2)
+		return -EIO;
+
+	for(i=L; i<n; i++) {
+		uint32_t w = buf[i];
+
+		for(j=0; j<ntaps; j++)
+			w ^= buf[i-taps[j]];
+		if(w)
+			return -EIO;
+	}
+	return 0;
+}
+
+/* One transfer of 'chunks' DMA buffers of 'len' bytes.
+ * Returns ns from start until completion is seen, or negative on error
+ */
+static
+s64 bist_xfer(struct board_data *board, unsigned chunks, uint32_t len, int *bad)
+{
+	unsigned i;
+	ktime_t start;
+	s64 ns;
 	int rc;
 
-	board = dev_get_drvdata(&dev->dev);
+	for(i=0; i<chunks; i++)
+		memset(board->kernel_mem_buf[i], BIST_POISON&0xff, len);
 
-	printk(KERN_DEBUG MOD_NAME ": Performing BIST routine...\n");
+	spin_lock_irq(&board->dma_queue.lock);
+	board->dma_irq_flag = 0;
+	dma_reset(board);
+	dma_enable(board, 0);
+	for(i=0; i<chunks; i++)
+		dma_push_buf(board, len, i==chunks-1);
+	mb();
+	start = ktime_get();
+	dma_enable(board, 1);
+	spin_unlock_irq(&board->dma_queue.lock);
 
-	/* allocate buffer */
-	tmp_buf = pci_alloc_consistent(dev, buf_size, &tmp_buf_dma);
+	rc = bist_wait(board);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock_irq(&board->dma_queue.lock);
+	for(i=0; !rc && i<chunks; i++) {
+		if(board->dma_resp_len[i]!=len)
+			*bad = 1; /* short transfer */
+	}
+	board->dma_irq_flag = 0;
+	dma_reset(board);
+	spin_unlock_irq(&board->dma_queue.lock);
+
+	if(rc)
+		return rc;
+
+	for(i=0; i<chunks; i++) {
+		if(bist_check(board->kernel_mem_buf[i], len))
+			*bad = 1;
+	}
+
+	return ns;
+}
+
+static
+int bist_cmp(const void *a, const void *b)
+{
+	s64 A = *(const s64*)a, B = *(const s64*)b;
+	return A<B ? -1 : A>B ? 1 : 0;
+}
+
+/* MB/s for size bytes in ns */
+static
+unsigned long long bist_rate(size_t size, s64 ns)
+{
+	return ns>0 ? div64_u64((u64)size*1000u, ns) : 0;
+}
+
+ssize_t BIST(struct board_data *board, char *out, size_t outlen)
+{
+	struct pci_dev *dev = board->pci_dev;
+	const size_t maxsize = DMA_BUF_COUNT*DMA_BUF_SIZE;
+	size_t size, pos = 0;
+	uint32_t mux_tmp;
+	unsigned nbad = 0;
+	int rc = 0;
+
+	spin_lock_irq(&board->dma_queue.lock);
+	if(board->read_in_progress) {
+		spin_unlock_irq(&board->dma_queue.lock);
+		return -EBUSY;
+	}
+	board->read_in_progress = 1;
+	/* overwrites any READ_MODE_SHARED acquisition */
+	board->shared_valid = 0;
+	spin_unlock_irq(&board->dma_queue.lock);
+
+	dev_info(&dev->dev, "Performing BIST routine...\n");
 
 	/* read mux setting */
 	mux_tmp = ioread32(board->bar0 + MUX_ADDR);
-	dev_info(&dev->dev, "MUX now %08x\n", (unsigned)mux_tmp);
+	dev_dbg(&dev->dev, "MUX now %08x\n", (unsigned)mux_tmp);
 
 	/* mux to PRBS */
 	iowrite32(1, board->bar0 + MUX_ADDR);
 
-	/* DMA transfer */
-    board->dma_irq_flag = 0;
-	t0 = ktime_get();
-	dma_enable(board, 0);
-	dma_push(board, tmp_buf_dma, buf_size, 1);
-	dma_enable(board, 1);
-    rc = wait_event_interruptible_timeout(board->dma_queue, board->dma_irq_flag != 0,
-		msecs_to_jiffies(1000));
-	t1 = ktime_get();
-
-	dev_info(&dev->dev, "wait_event %d\n", rc);
-	{
-		uint32_t val = ioread32(board->bar0+DMA_ADDR+DMA_OFFSET_STATUS);
-		if(val)
-			dev_warn(&dev->dev, "Response fifo not empty after BIST %08x\n", (unsigned)val);
-	}
+	pos += scnprintf(out+pos, outlen-pos,
+			"# size chunks MB/s(min med max) latency_us(min med max) data\n");
 
-	dma_enable(board, 0);
-    board->dma_irq_flag = 0;
+	for(size=BIST_MIN_SIZE; !rc && size<=maxsize; size*=4) {
+		unsigned chunks;
 
-	if (rc <= 0) {
-		dev_err(&dev->dev, "DMA was unable to finish\n");
-		rc = -1;
-	} else {
-		time_needed = ktime_to_ns(ktime_sub(t1, t0));
-
-		/* 953 = ns->s, b->Mb */
-		throughput = (buf_size*8)/do_div(time_needed,953);
-
-		printk(KERN_DEBUG MOD_NAME ":  DMA trans size: %d bytes\n",
-			buf_size);
-		printk(KERN_DEBUG MOD_NAME ":  DMA trans time: %llu ns\n",
-			time_needed);
-		printk(KERN_DEBUG MOD_NAME ":  DMA throughput: %llu Mbps\n",
-			throughput);
-		rc = 0;
-	}
+		for(chunks=1; !rc && chunks<=DMA_BUF_COUNT; chunks*=2) {
+			s64 ns[BIST_REPEAT];
+			uint32_t len = size/chunks;
+			int bad = 0;
+			unsigned r;
 
-	/* reset DMA engine for good measure */
-	dma_reset(board);
+			if(len>DMA_BUF_SIZE || len<PAGE_SIZE)
+				continue;
+
+			for(r=0; r<BIST_REPEAT && !rc; r++) {
+				ns[r] = bist_xfer(board, chunks, len, &bad);
+				if(ns[r]<0)
+					rc = ns[r];
+			}
+			if(rc)
+				break;
+
+			sort(ns, BIST_REPEAT, sizeof(ns[0]), bist_cmp, NULL);
+			nbad += bad;
+
+			/* fastest transfer has the highest rate */
+			pos += scnprintf(out+pos, outlen-pos, "%zu %u %llu %llu %llu %llu %llu %llu %s\n",
+					size, chunks,
+					bist_rate(size, ns[BIST_REPEAT-1]),
+					bist_rate(size, ns[BIST_REPEAT/2]),
+					bist_rate(size, ns[0]),
+					(unsigned long long)div_s64(ns[0], 1000),
+					(unsigned long long)div_s64(ns[BIST_REPEAT/2], 1000),
+					(unsigned long long)div_s64(ns[BIST_REPEAT-1], 1000),
+					bad ? "BAD" : "ok");
+		}
+	}
 
 	/* return mux to previous value */
 	iowrite32(mux_tmp, board->bar0 + MUX_ADDR);
 
-	/* free buffer */
-	pci_free_consistent(dev, buf_size, tmp_buf, tmp_buf_dma);
+	spin_lock_irq(&board->dma_queue.lock);
+	board->read_in_progress = 0;
+	spin_unlock_irq(&board->dma_queue.lock);
+
+	if(rc) {
+		dev_err(&dev->dev, "BIST DMA was unable to finish: %d\n", rc);
+		pos += scnprintf(out+pos, outlen-pos, "# FAIL error %d\n", rc);
+	} else if(nbad) {
+		dev_err(&dev->dev, "BIST found bad data in %u tests\n", nbad);
+		pos += scnprintf(out+pos, outlen-pos, "# FAIL bad data in %u tests\n", nbad);
+	} else {
+		dev_info(&dev->dev, "BIST complete\n");
+		pos += scnprintf(out+pos, outlen-pos, "# PASS\n");
+	}
 
-	return rc;
+	return pos;
 }
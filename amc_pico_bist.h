@@ -36,6 +36,7 @@
 #include <linux/pci.h>
 #include <linux/hrtimer.h>
 #include <linux/sched.h>
+#include <linux/sort.h>
 
 #include "amc_pico_internal.h"
 #include "amc_pico_regs.h"
@@ -44,15 +45,20 @@
 
 /**
  * \brief Built-In Self Test routine
- * \param dev pci device with amc_pico board_data as private data
- * \return 0 if the test was successful, -1 if the DMA did not work correctly
+ * \param board   amc_pico board_data
+ * \param out     buffer for the text report
+ * \param outlen  length of out
+ * \return length of the report, or -EBUSY if an acquisition is in progress.
+ *         The report ends with "# PASS" or "# FAIL ...".
  *
- * Performs a DMA transfer of 4 megabytes using the DMA on the FPGA while
- * measuring the time it takes. The DMA signals the interrupt when the
- * transfer finishes. The throughput is calculated from the time needed
- * to perform the transfer.
+ * Measures DMA of the FPGA PRBS generator into the DMA buffers.
+ * Sweeps transfer sizes and the number of DMA commands (chunks) they are
+ * split into, repeating each point.  Reports min/median/max throughput
+ * and latency from enabling the DMA engine until the completion interrupt
+ * wakes us.  Each chunk is checked to have been completely overwritten
+ * with a PRBS, of degree between 7 and 64.
  */
-int BIST(struct pci_dev *dev);
+ssize_t BIST(struct board_data *board, char *out, size_t outlen);
 
 
 #endif /* AMC_PICO_BIST_H_ */
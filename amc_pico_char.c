@@ -22,6 +22,433 @@
 
 
 #include "amc_pico_char.h"
+#include "amc_pico_trace.h"
+
+/* Wait for COND with dma_queue.lock held (released while sleeping).
+ * Evaluates to 0 when COND is true, or -ERESTARTSYS.
+ * In polled mode (irqmode=0) amc_isr() is called directly.
+ * When it had to wait, the delay since the last DMA_DONE goes in hist_wakeup.
+ */
+#define pico_wait_locked(board, COND) ({ \
+    int __rc = 0, __waited = !(COND); \
+    if (likely((board)->irqmode!=dmac_irq_poll)) { \
+        __rc = wait_event_interruptible_locked_irq((board)->dma_queue, COND); \
+    } else { \
+        const unsigned long __twait = msecs_to_jiffies(1); \
+        while(!(COND) && __rc>=0) { \
+            /* must unlock for call to amc_isr() as spin locks aren't recursive */ \
+            spin_unlock_irq(&(board)->dma_queue.lock); \
+            if(amc_isr((board)->pci_dev->irq, (board))==IRQ_NONE) \
+                __rc = wait_event_interruptible_timeout((board)->dma_queue, COND, __twait); \
+            spin_lock_irq(&(board)->dma_queue.lock); \
+        } \
+        if(__rc>0) __rc = 0; \
+    } \
+    if(__waited) \
+        trace_pico_read_wakeup(board, __rc); \
+    if(__waited && !__rc) \
+        pico_hist_since(&(board)->hist_wakeup, (board)->irq_ns); \
+    __rc; })
+
+/* In polled mode (irqmode=0) nothing else calls amc_isr(), so collect
+ * completions before poll() and O_NONBLOCK paths look at the DMA state.
+ * Call without dma_queue.lock held.
+ */
+static
+void pico_poll_isr(struct board_data *board)
+{
+    if (unlikely(board->irqmode==dmac_irq_poll))
+        amc_isr(board->pci_dev->irq, board);
+}
+
+/* copy_to_user() of DMA data, timed in hist_copy */
+static
+unsigned long pico_copy_out(struct board_data *board, void __user *to, const void *from, unsigned long n)
+{
+    u64 start = ktime_to_ns(ktime_get());
+    unsigned long ret = copy_to_user(to, from, n);
+    pico_hist_since(&board->hist_copy, start);
+    trace_pico_copy_done(board, n, ret);
+    return ret;
+}
+
+/* Length of the next ring buffer command, or 0 when all have been pushed.
+ * Call with dma_queue.lock held
+ */
+static
+uint32_t pico_ring_next(struct board_data *board)
+{
+    uint32_t len = DMA_BUF_SIZE;
+
+    if(!board->ring_stream) {
+        if(len > board->ring_unpushed)
+            len = board->ring_unpushed;
+        board->ring_unpushed -= len;
+    }
+    return len;
+}
+
+/* Start cycling DMA buffers, each raising an interrupt on completion.
+ * limit is the total number of bytes to acquire, or 0 to stream forever.
+ * Call with dma_queue.lock held
+ */
+static
+void pico_ring_arm(struct board_data *board, struct file_data *fdata, size_t limit)
+{
+    unsigned i;
+    uint32_t len;
+
+    board->read_in_progress = 1;
+    board->acq_owner = fdata;
+    board->acq_count = limit;
+    board->ring_stream = !limit;
+    board->ring_unpushed = limit;
+    board->ring_seq = 0;
+    board->ring_offset = 0;
+    board->ring_overruns = 0;
+    /* the published READ_MODE_SHARED acquisition will be overwritten */
+    if(fdata)
+        board->shared_valid = 0;
+    /* keep pending ABORT_READ */
+    if(board->dma_irq_flag!=2)
+        board->dma_irq_flag = 0;
+
+    dma_reset(board);
+    dma_enable(board, 0);
+    for(i=0; i<DMA_BUF_COUNT && (len = pico_ring_next(board))!=0; i++)
+        dma_push_buf(board, len, 1);
+    mb();
+    dma_enable(board, 1);
+    board->arm_ns = board->acq_arm_ns = ktime_to_ns(ktime_get());
+    board->acq_seq++;
+    board->arm_config = board->acq_config;
+
+    dev_dbg(&board->pci_dev->dev, "ring started, limit %zu\n", limit);
+}
+
+/* Remember the acquisition just completed for char_put_header().
+ * Call with dma_queue.lock held
+ */
+static
+void pico_acq_snapshot(struct board_data *board, struct pico_read_header *hdr)
+{
+    hdr->seq = board->acq_seq;
+    hdr->arm_ns = board->acq_arm_ns;
+    hdr->done_ns = board->irq_ns;
+    hdr->bytes = board->dma_bytes_trans;
+    hdr->config = board->arm_config;
+}
+
+/* A one-shot acquisition has finished.  All chunks are complete,
+ * or the hardware stopped early (short response), or aborted.
+ * Call with dma_queue.lock held
+ */
+static
+int pico_oneshot_done(struct board_data *board)
+{
+    unsigned last;
+
+    if(board->dma_irq_flag==2)
+        return 1;
+    if(!board->ring_unpushed && board->dma_completed==board->dma_pushed)
+        return 1;
+    if(!board->dma_completed)
+        return 0;
+
+    last = (board->dma_completed-1)%DMA_CMD_RING;
+    return board->dma_resp_len[last] < board->dma_push_len[last];
+}
+
+/* Abandon the current acquisition.  Must not have a read() waiting on it.
+ * Call with dma_queue.lock held
+ */
+static
+void pico_acq_stop(struct board_data *board)
+{
+    dma_reset(board);
+    board->acq_owner = NULL;
+    board->read_in_progress = 0;
+    board->dma_irq_flag = 0;
+
+    dev_dbg(&board->pci_dev->dev, "acquisition stopped, %u overruns\n",
+            (unsigned)board->ring_overruns);
+}
+
+/* Start a READ_MODE_SHARED acquisition, which no FD owns.
+ * Call with dma_queue.lock held, and read_in_progress clear
+ */
+static
+void pico_shared_arm(struct board_data *board, size_t count)
+{
+    /* ABORT_READ is tracked by shared_aborts instead */
+    board->dma_irq_flag = 0;
+    pico_ring_arm(board, NULL, count);
+    board->shared_armed = 1;
+}
+
+/* The READ_MODE_SHARED acquisition has finished (pico_oneshot_done()).
+ * Unless aborted, make it available to all readers.
+ * Call with dma_queue.lock held
+ */
+static
+void pico_shared_complete(struct board_data *board)
+{
+    size_t len = 0;
+    unsigned i;
+
+    for(i=0; i<board->dma_completed; i++)
+        len += board->dma_resp_len[i%DMA_CMD_RING];
+
+    if(board->dma_completed!=board->dma_pushed)
+        dma_reset(board); /* stopped early, flush commands not executed */
+
+    board->dma_bytes_trans = len;
+    if(board->dma_irq_flag!=2) {
+        board->shared_seq++;
+        board->shared_len = len;
+        board->shared_valid = 1;
+        pico_acq_snapshot(board, &board->shared_hdr);
+    }
+    board->dma_irq_flag = 0;
+    board->shared_armed = 0;
+    board->read_in_progress = board->shared_copying!=0;
+    wake_up_locked(&board->dma_queue);
+}
+
+/* An FD leaves READ_MODE_SHARED.  The last one stops any acquisition.
+ * Call with dma_queue.lock held
+ */
+static
+void pico_shared_leave(struct board_data *board)
+{
+    if(--board->shared_readers==0 && board->shared_armed) {
+        dma_reset(board);
+        board->shared_armed = 0;
+        board->dma_irq_flag = 0;
+        board->read_in_progress = board->shared_copying!=0;
+        wake_up_locked(&board->dma_queue);
+    }
+}
+
+/* Number of buffers dequeued with DMA_DQBUF and not yet handed back */
+static inline
+unsigned pico_ring_held(struct board_data *board)
+{
+    return board->ring_seq + DMA_BUF_COUNT - board->dma_pushed;
+}
+
+/* Hand the oldest buffer not owned by the DMA engine back to it.
+ * Call with dma_queue.lock held
+ */
+static
+void pico_ring_push(struct board_data *board)
+{
+    uint32_t len = pico_ring_next(board);
+
+    if(!len)
+        return;
+
+    if(board->dma_pushed==board->dma_completed) {
+        /* all buffers were full, so DMA engine was idle and data was lost */
+        board->ring_overruns++;
+    }
+    /* DMA remains enabled while pushing */
+    dma_push_buf(board, len, 1);
+}
+
+/* Start the stream if necessary, and wait for a completed buffer.
+ * On success acq_busy is set, and the caller must clear it.
+ * Call with dma_queue.lock held.
+ */
+static
+int pico_stream_wait(struct board_data *board, struct file_data *fdata, int nonblock)
+{
+    int rc;
+
+    if((board->read_in_progress && board->acq_owner!=fdata) || board->acq_busy) {
+        dev_dbg(&board->pci_dev->dev, "  read(), concurrent read()s not allowed\n");
+        return -EIO;
+    }
+
+    if(!board->acq_owner)
+        pico_ring_arm(board, fdata, 0);
+
+    if(nonblock && board->dma_irq_flag!=2 && board->dma_completed==board->ring_seq)
+        return -EAGAIN;
+
+    board->acq_busy = 1;
+    rc = pico_wait_locked(board, board->dma_irq_flag==2 || board->dma_completed!=board->ring_seq);
+    if(!rc && board->dma_irq_flag==2)
+        rc = -ECANCELED;
+
+    if(rc) {
+        board->acq_busy = 0;
+        pico_acq_stop(board);
+        dev_dbg(&board->pci_dev->dev, "  stream interrupted: %d\n", rc);
+        return rc;
+    }
+    board->dma_irq_flag = 0;
+    return 0;
+}
+
+/* Position in the DMA segments of a pinned user buffer */
+struct pico_direct_xfer {
+    struct scatterlist *sg;
+    size_t skip; /* bytes of sg already pushed */
+    size_t left; /* bytes not yet pushed */
+    unsigned ncmd;
+};
+
+/* Push commands for the next segments of a direct transfer.
+ * Segments are split so no command exceeds DMA_BUF_SIZE, the largest the
+ * other modes give the DMA engine.  At most DMA_CMD_FIFO_DEPTH commands
+ * are in flight, and an interrupt is requested every DMA_CMD_FIFO_DEPTH/2
+ * commands to refill.
+ * Call with dma_queue.lock held
+ */
+static
+void pico_direct_push(struct board_data *board, struct pico_direct_xfer *X)
+{
+    while(X->left && board->dma_pushed-board->dma_completed < DMA_CMD_FIFO_DEPTH) {
+        size_t len = sg_dma_len(X->sg)-X->skip;
+        dma_addr_t addr = sg_dma_address(X->sg)+X->skip;
+        int irq;
+
+        if(len>X->left)
+            len = X->left;
+        if(len>DMA_BUF_SIZE)
+            len = DMA_BUF_SIZE;
+
+        X->left -= len;
+        X->ncmd++;
+        irq = !X->left || X->ncmd%(DMA_CMD_FIFO_DEPTH/2)==0;
+
+        dma_push(board, addr, len, irq);
+
+        X->skip += len;
+        if(X->skip==sg_dma_len(X->sg)) {
+            X->sg = sg_next(X->sg);
+            X->skip = 0;
+        }
+    }
+}
+
+static
+ssize_t char_read_direct(struct file_data *fdata, char __user *buf, size_t count)
+{
+    struct board_data *board = fdata->board;
+    unsigned long addr = (unsigned long)buf;
+    struct pico_ubuf *ubuf = NULL, *tmpbuf = NULL;
+    struct pico_direct_xfer X;
+    size_t nsent = 0;
+    unsigned seen;
+    int rc, cond, stopped = 0, i;
+
+    if(!count)
+        return 0;
+    if(count%4 || addr%4)
+        return -EINVAL;
+
+    spin_lock_irq(&board->dma_queue.lock);
+    if(board->read_in_progress) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        dev_dbg(&board->pci_dev->dev, "  read(), concurrent read()s not allowed\n");
+        return -EIO;
+    }
+    /* claim so the registered buffer can't be unmapped */
+    board->read_in_progress = 1;
+    board->acq_owner = fdata;
+    board->acq_busy = 1;
+    ubuf = fdata->ubuf;
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    if(!ubuf || addr<ubuf->addr || addr+count>ubuf->addr+ubuf->len) {
+        /* not in registered buffer, pin for this read() only */
+        ubuf = tmpbuf = pico_ubuf_pin(board, addr, count, 0);
+        if(IS_ERR(tmpbuf)) {
+            rc = PTR_ERR(tmpbuf);
+            spin_lock_irq(&board->dma_queue.lock);
+            board->read_in_progress = 0;
+            board->acq_owner = NULL;
+            board->acq_busy = 0;
+            spin_unlock_irq(&board->dma_queue.lock);
+            return rc;
+        }
+    } else {
+        pico_ubuf_sync_for_device(board, ubuf);
+    }
+
+    /* find first segment */
+    X.sg = ubuf->sgt.sgl;
+    X.skip = addr-ubuf->addr;
+    X.left = count;
+    X.ncmd = 0;
+    for(i=0; i<ubuf->nents && X.skip>=sg_dma_len(X.sg); i++) {
+        X.skip -= sg_dma_len(X.sg);
+        X.sg = sg_next(X.sg);
+    }
+
+    spin_lock_irq(&board->dma_queue.lock);
+
+    dma_reset(board);
+    dma_enable(board, 0);
+    pico_direct_push(board, &X);
+    mb();
+    dma_enable(board, 1);
+    board->arm_ns = board->acq_arm_ns = ktime_to_ns(ktime_get());
+    board->acq_seq++;
+    board->arm_config = board->acq_config;
+
+    seen = 0;
+    rc = 0;
+    while(1) {
+        rc = pico_wait_locked(board, board->dma_irq_flag==2
+                              || board->dma_completed==board->dma_pushed
+                              || (X.left && board->dma_pushed-board->dma_completed<=DMA_CMD_FIFO_DEPTH/2));
+        if(rc || board->dma_irq_flag==2)
+            break;
+
+        /* a short response means the transfer was stopped by hardware */
+        for(; seen!=board->dma_completed; seen++) {
+            uint32_t rlen = board->dma_resp_len[seen%DMA_CMD_RING];
+            nsent += rlen;
+            if(rlen<board->dma_push_len[seen%DMA_CMD_RING])
+                stopped = 1;
+        }
+
+        if(stopped || (!X.left && board->dma_completed==board->dma_pushed))
+            break;
+
+        pico_direct_push(board, &X);
+    }
+
+    cond = board->dma_irq_flag;
+    board->dma_irq_flag = 0;
+    if(rc || cond==2 || stopped || X.left) {
+        /* flush commands not executed */
+        dma_reset(board);
+    }
+    board->dma_bytes_trans = nsent;
+    board->read_in_progress = 0;
+    board->acq_owner = NULL;
+    board->acq_busy = 0;
+
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    dev_dbg(&board->pci_dev->dev, "direct read() %zu of %zu in %u cmds rc=%d cond=%d\n",
+            nsent, count, X.ncmd, rc, cond);
+
+    if(tmpbuf)
+        pico_ubuf_unpin(board, tmpbuf);
+    else
+        pico_ubuf_sync_for_cpu(board, ubuf);
+
+    if(rc)
+        return rc;
+    else if(cond==2)
+        return -ECANCELED;
+    return nsent;
+}
 
 static
 int char_open(struct inode *inode, struct file *file)
@@ -67,154 +494,733 @@ unmod:
 }
 
 static
-int char_release(struct inode *inode, struct file *file)
+int char_release(struct inode *inode, struct file *file)
+{
+    struct file_data *fdata = (struct file_data *)file->private_data;
+	struct board_data *board = container_of(inode->i_cdev, struct board_data, cdev);
+
+	dev_dbg(&board->pci_dev->dev, "char_release()\n");
+
+    spin_lock_irq(&board->dma_queue.lock);
+    if(board->acq_owner==fdata)
+        pico_acq_stop(board);
+    if(fdata->read_mode==READ_MODE_SHARED)
+        pico_shared_leave(board);
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    if(fdata->ubuf)
+        pico_ubuf_unpin(board, fdata->ubuf);
+
+    kfree(fdata);
+    kobject_put(&board->kobj);
+    kobject_put(&board->cdev.kobj);
+	module_put(THIS_MODULE);
+	return 0;
+}
+
+#ifdef CONFIG_AMC_PICO_FRIB
+static ssize_t frib_write_reg(struct board_data *board,
+                             const char __user *buf,
+                             size_t count,
+                             loff_t *pos);
+static ssize_t frib_read_reg(struct board_data *board,
+                             char __user *buf,
+                             size_t count,
+                             loff_t *pos);
+static ssize_t frib_read_capture(struct board_data *board,
+                                 char __user *buf,
+                                 size_t count,
+                                 loff_t *pos);
+static ssize_t frib_read_events(struct board_data *board,
+                                char __user *buf,
+                                size_t count,
+                                int nonblock);
+static long frib_reg_batch(struct board_data *board,
+                           struct pico_reg_batch __user *arg);
+#endif
+
+/* One-shot acquisition larger than the DMA buffers.
+ * Completed buffers are copied out, and re-pushed, while later ones are in flight.
+ */
+static
+ssize_t char_read_ring(struct file_data *fdata, char __user *buf, size_t count)
+{
+    struct board_data *board = fdata->board;
+    size_t ncopied = 0;
+    int rc = 0, stopped = 0;
+
+    spin_lock_irq(&board->dma_queue.lock);
+
+    if(board->read_in_progress) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        dev_dbg(&board->pci_dev->dev, "  read(), concurrent read()s not allowed\n");
+        return -EIO;
+    }
+
+    pico_ring_arm(board, fdata, count);
+    board->acq_busy = 1;
+
+    while(ncopied<count) {
+        unsigned idx = board->ring_seq%DMA_BUF_COUNT;
+        uint32_t rlen, plen;
+
+        rc = pico_wait_locked(board, board->dma_irq_flag==2 || board->dma_completed!=board->ring_seq);
+        if(!rc && board->dma_irq_flag==2)
+            rc = -ECANCELED;
+        if(rc)
+            break;
+
+        rlen = board->dma_resp_len[board->ring_seq%DMA_CMD_RING];
+        plen = board->dma_push_len[board->ring_seq%DMA_CMD_RING];
+
+        /* buffer at ring_seq is not owned by the DMA engine */
+        spin_unlock_irq(&board->dma_queue.lock);
+        rc = pico_copy_out(board, buf+ncopied, board->kernel_mem_buf[idx], rlen) ? -EFAULT : 0;
+        spin_lock_irq(&board->dma_queue.lock);
+        if(rc)
+            break;
+
+        ncopied += rlen;
+
+        if(rlen<plen) {
+            /* stopped by hardware, eg. end of trigger window */
+            stopped = 1;
+            break;
+        }
+
+        board->ring_seq++;
+        pico_ring_push(board);
+        if(board->ring_overruns) {
+            /* DMA engine was idle, so samples after those copied were lost */
+            rc = -EOVERFLOW;
+            break;
+        }
+    }
+
+    board->acq_busy = 0;
+    if(rc || stopped)
+        dma_reset(board); /* flush commands not executed */
+    board->dma_bytes_trans = ncopied;
+    pico_acq_snapshot(board, &fdata->hdr);
+    board->dma_irq_flag = 0;
+    board->read_in_progress = 0;
+    board->acq_owner = NULL;
+
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    dev_dbg(&board->pci_dev->dev, "large read() %zu of %zu, %u overruns, rc=%d\n",
+            ncopied, count, (unsigned)board->ring_overruns, rc);
+
+    return rc ? rc : ncopied;
+}
+
+static
+ssize_t char_read_stream(struct file_data *fdata, char __user *buf, size_t count, int nonblock)
+{
+    struct board_data *board = fdata->board;
+    ssize_t ret = 0;
+    int rc;
+
+    if(nonblock)
+        pico_poll_isr(board);
+
+    spin_lock_irq(&board->dma_queue.lock);
+
+    if(board->acq_owner==fdata && pico_ring_held(board)) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        dev_dbg(&board->pci_dev->dev, "  read(), can't mix with DMA_DQBUF\n");
+        return -EBUSY;
+    }
+
+    rc = pico_stream_wait(board, fdata, nonblock);
+    if(rc) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        return rc;
+    }
+
+    /* drain completed buffers.  The buffer at ring_seq is not owned by
+     * the DMA engine, so copy without the lock.
+     */
+    while(count && board->acq_owner==fdata && board->dma_completed!=board->ring_seq) {
+        unsigned idx = board->ring_seq%DMA_BUF_COUNT;
+        uint32_t rlen = board->dma_resp_len[board->ring_seq%DMA_CMD_RING];
+        size_t n = rlen-board->ring_offset;
+        const char *src = (const char*)board->kernel_mem_buf[idx] + board->ring_offset;
+
+        if(n>count) n = count;
+
+        spin_unlock_irq(&board->dma_queue.lock);
+        rc = pico_copy_out(board, buf, src, n) ? -EFAULT : 0;
+        spin_lock_irq(&board->dma_queue.lock);
+        if(rc) break;
+
+        buf += n;
+        count -= n;
+        ret += n;
+        board->ring_offset += n;
+
+        if(board->ring_offset>=rlen && board->acq_owner==fdata) {
+            board->ring_seq++;
+            board->ring_offset = 0;
+            pico_ring_push(board);
+        }
+    }
+    board->acq_busy = 0;
+
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    return ret ? ret : rc;
+}
+
+/* Copy out the next acquisition not yet seen by this FD.
+ * Readers which fall behind skip to the latest, and count those missed.
+ */
+static
+ssize_t char_read_shared(struct file_data *fdata, char __user *buf, size_t count, int nonblock)
+{
+    struct board_data *board = fdata->board;
+    uint32_t aborts;
+    size_t len, i;
+    int rc = 0;
+
+    if(!count)
+        return 0;
+
+    if(nonblock)
+        pico_poll_isr(board);
+
+    spin_lock_irq(&board->dma_queue.lock);
+    aborts = board->shared_aborts;
+    fdata->shared_reading++;
+
+    /* DMA buffers hold an acquisition we haven't seen once it is complete,
+     * and until the next is armed, or another read mode (or BIST) uses them.
+     */
+    while(board->shared_armed || !board->shared_valid || board->shared_seq==fdata->shared_seq) {
+        if(board->shared_aborts!=aborts) {
+            rc = -ECANCELED;
+            break;
+        }
+        if(board->shared_armed && pico_oneshot_done(board)) {
+            pico_shared_complete(board);
+            continue;
+        }
+        if(!board->read_in_progress) {
+            /* card idle, start the next acquisition */
+            pico_shared_arm(board, min_t(size_t, count, DMA_BUF_COUNT*DMA_BUF_SIZE));
+            continue;
+        }
+        if(nonblock) {
+            rc = -EAGAIN;
+            break;
+        }
+        rc = pico_wait_locked(board, board->shared_aborts!=aborts
+                              || !board->read_in_progress
+                              || (board->shared_armed && pico_oneshot_done(board))
+                              || (!board->shared_armed && board->shared_valid
+                                  && board->shared_seq!=fdata->shared_seq));
+        if(rc)
+            break;
+    }
+    fdata->shared_reading--;
+
+    if(rc) {
+        /* don't leave an aborted acquisition for others to find */
+        if(board->shared_armed && pico_oneshot_done(board))
+            pico_shared_complete(board);
+        spin_unlock_irq(&board->dma_queue.lock);
+        return rc;
+    }
+
+    fdata->shared_missed += board->shared_seq - fdata->shared_seq - 1;
+    fdata->shared_seq = board->shared_seq;
+    fdata->hdr = board->shared_hdr;
+    len = min_t(size_t, count, board->shared_len);
+    /* prevent re-arming while we copy */
+    board->shared_copying++;
+    board->read_in_progress = 1;
+
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    for(i=0; !rc && i<len; i+=DMA_BUF_SIZE) {
+        size_t n = min_t(size_t, len-i, DMA_BUF_SIZE);
+        rc = pico_copy_out(board, buf+i, board->kernel_mem_buf[i/DMA_BUF_SIZE], n) ? -EFAULT : 0;
+    }
+
+    spin_lock_irq(&board->dma_queue.lock);
+    if(--board->shared_copying==0 && !board->shared_armed) {
+        board->read_in_progress = 0;
+        wake_up_locked(&board->dma_queue);
+    }
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    dev_dbg(&board->pci_dev->dev, "shared read() #%u %zu bytes, %u missed, rc=%d\n",
+            (unsigned)fdata->shared_seq, len, (unsigned)fdata->shared_missed, rc);
+
+    return rc ? rc : len;
+}
+
+/* Wait for the next completed stream buffer, and pass ownership to user space */
+static
+long char_dqbuf(struct file_data *fdata, struct pico_dma_buf __user *arg, int nonblock)
+{
+    struct board_data *board = fdata->board;
+    struct pico_dma_buf info;
+    int rc;
+
+    if(nonblock)
+        pico_poll_isr(board);
+
+    spin_lock_irq(&board->dma_queue.lock);
+
+    if(board->acq_owner==fdata && pico_ring_held(board)>=DMA_BUF_COUNT) {
+        /* nothing left for the DMA engine to complete */
+        spin_unlock_irq(&board->dma_queue.lock);
+        return -ENOBUFS;
+    }
+
+    rc = pico_stream_wait(board, fdata, nonblock);
+    if(rc) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        return rc;
+    }
+
+    info.index = board->ring_seq%DMA_BUF_COUNT;
+    info.offset = board->ring_offset;
+    info.length = board->dma_resp_len[board->ring_seq%DMA_CMD_RING]-board->ring_offset;
+    info.seq = board->ring_seq;
+
+    board->ring_seq++;
+    board->ring_offset = 0;
+    board->acq_busy = 0;
+
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    dev_dbg(&board->pci_dev->dev, "DQBUF %u [%u, %u)\n", (unsigned)info.index,
+            (unsigned)info.offset, (unsigned)(info.offset+info.length));
+
+    return copy_to_user(arg, &info, sizeof(info)) ? -EFAULT : 0;
+}
+
+/* Give a buffer from char_dqbuf() back to the DMA engine */
+static
+long char_qbuf(struct file_data *fdata, uint32_t index)
+{
+    struct board_data *board = fdata->board;
+    long ret = 0;
+
+    spin_lock_irq(&board->dma_queue.lock);
+
+    if(board->acq_owner!=fdata || !pico_ring_held(board)) {
+        ret = -EINVAL;
+
+    } else if(index!=board->dma_pushed%DMA_BUF_COUNT) {
+        /* buffers must be returned in the order they were dequeued */
+        ret = -EINVAL;
+
+    } else {
+        pico_ring_push(board);
+    }
+
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    dev_dbg(&board->pci_dev->dev, "QBUF %u -> %ld\n", (unsigned)index, ret);
+
+    return ret;
+}
+
+static
+ssize_t char_read_oneshot(
+	struct file *filp,
+	char __user *buf,
+	size_t count,
+	loff_t *pos
+)
+{
+    struct file_data *fdata = (struct file_data *)filp->private_data;
+    struct board_data *board = fdata->board;
+	int rc;
+	size_t tmp_count, nsent;
+	unsigned i;
+
+    if(filp->f_flags&O_NONBLOCK)
+        pico_poll_isr(board);
+
+    spin_lock_irq(&board->dma_queue.lock);
+
+    if(board->acq_owner==fdata) {
+        /* already armed by ARM_READ or a non-blocking read() */
+        if(board->acq_busy) {
+            spin_unlock_irq(&board->dma_queue.lock);
+            dev_dbg(&board->pci_dev->dev, "  read(), concurrent read()s not allowed\n");
+            return -EIO;
+        }
+        if(count > board->acq_count)
+            count = board->acq_count;
+
+    } else if(board->read_in_progress) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        dev_dbg(&board->pci_dev->dev, "  read(), concurrent read()s not allowed\n");
+		return -EIO;
+
+    } else if(count > DMA_BUF_COUNT*DMA_BUF_SIZE) {
+        /* larger than DMA buffers, so must recycle them while in progress */
+        spin_unlock_irq(&board->dma_queue.lock);
+        if(filp->f_flags&O_NONBLOCK)
+            return -EINVAL;
+        return char_read_ring(fdata, buf, count);
+
+    } else {
+        pico_ring_arm(board, fdata, count);
+    }
+
+    if((filp->f_flags&O_NONBLOCK) && !pico_oneshot_done(board)) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        return -EAGAIN;
+    }
+
+    /* Each chunk raises DMA_DONE.  Chunk i is copied while later chunks
+     * are still being written.
+     */
+    board->acq_busy = 1;
+    rc = 0;
+    nsent = 0;
+    for(i=0, tmp_count=count; tmp_count && !rc; i++) {
+        size_t n;
+
+        rc = pico_wait_locked(board, board->dma_completed>i || pico_oneshot_done(board));
+        if(!rc && board->dma_irq_flag==2)
+            rc = -ECANCELED;
+        if(rc)
+            break;
+
+        if(i>=board->dma_completed) {
+            /* stopped early by hardware, flush commands not executed */
+            if(board->dma_completed!=board->dma_pushed)
+                dma_reset(board);
+            break;
+        }
+
+        /* Copy only what the DMA engine reports having written.
+         * Sometimes the DMA done interrupt comes even though nothing has been
+         * transfered, which shows up as a zero length response.
+         */
+        n = board->dma_resp_len[i];
+        if(n>tmp_count)
+            n = tmp_count;
+
+        if(n) {
+            spin_unlock_irq(&board->dma_queue.lock);
+            rc = pico_copy_out(board, buf + nsent, board->kernel_mem_buf[i], n) ? -EFAULT : 0;
+            spin_lock_irq(&board->dma_queue.lock);
+        }
+
+        nsent += n;
+        tmp_count -= n;
+
+        if(n<board->dma_push_len[i])
+            break; /* short, eg. end of trigger window.  No more data follows */
+    }
+
+    board->dma_irq_flag = 0;
+    board->read_in_progress = 0;
+    board->acq_owner = NULL;
+    board->acq_busy = 0;
+    if(rc || board->dma_completed!=board->dma_pushed)
+        dma_reset(board); /* error, or count less than armed */
+    board->dma_bytes_trans = rc ? 0 : nsent;
+    pico_acq_snapshot(board, &fdata->hdr);
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    dev_dbg(&board->pci_dev->dev, "read() complete w/ rc=%d, %zu transferred\n",
+            rc, nsent);
+
+    if(rc)
+        return rc;
+
+	*pos += nsent;
+
+	return nsent;
+}
+
+/* Store the header for the last acquisition read() by this FD */
+static
+int char_put_header(struct file_data *fdata, char __user *buf)
+{
+    struct pico_read_header *hdr = &fdata->hdr;
+
+    hdr->magic = PICO_READ_HEADER_MAGIC;
+    hdr->size = sizeof(*hdr);
+    hdr->reserved = 0;
+
+    return copy_to_user(buf, hdr, sizeof(*hdr)) ? -EFAULT : 0;
+}
+
+static
+ssize_t char_do_read(
+	struct file *filp,
+	char __user *buf,
+	size_t count,
+	loff_t *pos
+)
+{
+    struct file_data *fdata = (struct file_data *)filp->private_data;
+    struct board_data *board = fdata->board;
+    const size_t hsize = fdata->read_header ? sizeof(struct pico_read_header) : 0;
+    ssize_t ret;
+
+    dev_dbg(&board->pci_dev->dev, "  read(), site_mode=%u count %zd\n", fdata->site_mode, count);
+    if(0) {}
+#ifdef CONFIG_AMC_PICO_FRIB
+    else if(board->site==USER_SITE_FRIB) {
+        switch(fdata->site_mode) {
+        case 0:  break;
+        case 1:  return frib_read_reg(board, buf, count, pos);
+        case 2:  return frib_read_capture(board, buf, count, pos);
+        case FRIB_SITE_MODE_EVENTS:
+            return frib_read_events(board, buf, count, filp->f_flags&O_NONBLOCK);
+        default: return -EINVAL;
+        }
+    }
+#endif
+    else if(fdata->site_mode!=0)
+        return -EINVAL;
+
+    if(fdata->read_mode==READ_MODE_STREAM)
+        return hsize ? -EINVAL : char_read_stream(fdata, buf, count, filp->f_flags&O_NONBLOCK);
+    else if(fdata->read_mode==READ_MODE_DIRECT)
+        /* blocks until the card has written into the user pages */
+        return (hsize || (filp->f_flags&O_NONBLOCK)) ? -EINVAL : char_read_direct(fdata, buf, count);
+
+    /* with SET_READ_HEADER, data follows the header */
+    if(hsize && count<=hsize)
+        return -EINVAL;
+
+    if(fdata->read_mode==READ_MODE_SHARED)
+        ret = char_read_shared(fdata, buf+hsize, count-hsize, filp->f_flags&O_NONBLOCK);
+    else
+        ret = char_read_oneshot(filp, buf+hsize, count-hsize, pos);
+
+    if(ret>=0 && hsize) {
+        int rc = char_put_header(fdata, buf);
+        if(rc)
+            return rc;
+        ret += hsize;
+    }
+    return ret;
+}
+
+static
+ssize_t char_read(struct file *filp, char __user *buf, size_t count, loff_t *pos)
+{
+    struct file_data *fdata = (struct file_data *)filp->private_data;
+    struct board_data *board = fdata->board;
+    ssize_t ret = char_do_read(filp, buf, count, pos);
+
+    if(fdata->site_mode==0) {
+        if(ret>=0)
+            atomic64_inc(&board->stat_reads);
+        else if(ret==-ECANCELED)
+            atomic64_inc(&board->stat_cancelled);
+    }
+    return ret;
+}
+
+static
+long char_map_user_buf(struct file_data *fdata, const struct pico_user_buf __user *arg)
+{
+    struct board_data *board = fdata->board;
+    struct pico_user_buf ureq;
+    struct pico_ubuf *ubuf;
+    long ret = 0;
+
+    if(copy_from_user(&ureq, arg, sizeof(ureq)))
+        return -EFAULT;
+
+    if(ureq.addr%4 || ureq.length%4 || ureq.addr!=(unsigned long)ureq.addr
+            || ureq.length!=(size_t)ureq.length || ureq.length>damc_max_user_buf)
+        return -EINVAL;
+
+    ubuf = pico_ubuf_pin(board, ureq.addr, ureq.length, 1);
+    if(IS_ERR(ubuf))
+        return PTR_ERR(ubuf);
+
+    spin_lock_irq(&board->dma_queue.lock);
+    if(fdata->ubuf)
+        ret = -EBUSY;
+    else
+        fdata->ubuf = ubuf;
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    if(ret)
+        pico_ubuf_unpin(board, ubuf);
+    return ret;
+}
+
+static
+long char_unmap_user_buf(struct file_data *fdata)
+{
+    struct board_data *board = fdata->board;
+    struct pico_ubuf *ubuf;
+
+    spin_lock_irq(&board->dma_queue.lock);
+    if(board->acq_owner==fdata && board->acq_busy) {
+        spin_unlock_irq(&board->dma_queue.lock);
+        return -EBUSY;
+    }
+    ubuf = fdata->ubuf;
+    fdata->ubuf = NULL;
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    if(!ubuf)
+        return -EINVAL;
+
+    pico_ubuf_unpin(board, ubuf);
+    return 0;
+}
+
+/* Configuration register setters.  Write through board->regs.
+ * Call with reg_lock held.
+ */
+
+static
+void pico_write_range(struct board_data *board, uint8_t range)
+{
+    board->regs.control &= ~0xFFUL;
+    board->regs.control |= range;
+    iowrite32(board->regs.control, board->bar0 + PICO_ADDR);
+}
+
+/* freq. must be checked by pico_fsamp_valid().  Returns the divider */
+static
+uint32_t pico_write_fsamp(struct board_data *board, uint32_t freq)
 {
-    struct file_data *fdata = (struct file_data *)file->private_data;
-	struct board_data *board = container_of(inode->i_cdev, struct board_data, cdev);
+    board->regs.conv_gen = PICO_CLK_FREQ / freq - 1;
+    iowrite32(board->regs.conv_gen, board->bar0 + PICO_ADDR + PICO_CONV_GEN);
+    return board->regs.conv_gen;
+}
 
-	dev_dbg(&board->pci_dev->dev, "char_release()\n");
+static
+int pico_fsamp_valid(uint32_t freq)
+{
+    return freq && freq<=PICO_ADC_MAX_FREQ && PICO_CLK_FREQ/freq-1<=PICO_CONV_MAX-1;
+}
 
-    kfree(fdata);
-    kobject_put(&board->kobj);
-    kobject_put(&board->cdev.kobj);
-	module_put(THIS_MODULE);
-	return 0;
+/* Returns the new TRG_OFFS_CTRL */
+static
+uint32_t pico_write_trg(struct board_data *board, uint32_t limit, uint32_t nr_samp,
+                        uint32_t ch_sel, uint32_t mode)
+{
+    uint32_t ctrl_tmp = board->regs.trg_ctrl;
+
+    board->regs.trg_limit = limit;
+    board->regs.trg_nrsamp = nr_samp;
+    iowrite32(limit, board->bar0 + PICO_ADDR + TRG_OFFS_LIMIT);
+    iowrite32(nr_samp, board->bar0 + PICO_ADDR + TRG_OFFS_NRSAMP);
+
+    /* change the trigger edge */
+    ctrl_tmp &= ~(0x3);
+    ctrl_tmp |= mode;
+
+    /* change the channel bits */
+    ctrl_tmp &= ~(0x7 << TRG_CTRL_CH_SHIFT);
+    ctrl_tmp |= ch_sel << TRG_CTRL_CH_SHIFT;
+
+    board->regs.trg_ctrl = ctrl_tmp;
+    iowrite32(ctrl_tmp, board->bar0 + PICO_ADDR + TRG_OFFS_CTRL);
+    return ctrl_tmp;
 }
 
-#ifdef CONFIG_AMC_PICO_FRIB
-static ssize_t frib_write_reg(struct board_data *board,
-                             const char __user *buf,
-                             size_t count,
-                             loff_t *pos);
-static ssize_t frib_read_reg(struct board_data *board,
-                             char __user *buf,
-                             size_t count,
-                             loff_t *pos);
-static ssize_t frib_read_capture(struct board_data *board,
-                                 char __user *buf,
-                                 size_t count,
-                                 loff_t *pos);
-#endif
+static
+void pico_write_ring_buf(struct board_data *board, uint32_t delay)
+{
+    board->regs.ring_delay = delay;
+    iowrite32(delay, board->bar0 + PICO_ADDR + RING_BUFF_OFFS_DELAY);
+}
 
+/* Set gate (MUX_TRG_*) or conv (MUX_CONV_*) field.  Returns the new PICO_CONV_TRG */
 static
-ssize_t char_read(
-	struct file *filp,
-	char __user *buf,
-	size_t count,
-	loff_t *pos
-)
+uint32_t pico_write_conv_trg(struct board_data *board, uint32_t mask, unsigned shift, uint32_t val)
 {
-    struct file_data *fdata = (struct file_data *)filp->private_data;
-    struct board_data *board = fdata->board;
-	int rc, cond;
-	size_t tmp_count;
-	int i;
+    uint32_t ctrl_tmp = board->regs.conv_trg;
 
-    dev_dbg(&board->pci_dev->dev, "  read(), site_mode=%u count %zd\n", fdata->site_mode, count);
-    if(0) {}
-#ifdef CONFIG_AMC_PICO_FRIB
-    else if(board->site==USER_SITE_FRIB) {
-        switch(fdata->site_mode) {
-        case 0:  break;
-        case 1:  return frib_read_reg(board, buf, count, pos);
-        case 2:  return frib_read_capture(board, buf, count, pos);
-        default: return -EINVAL;
-        }
-    }
-#endif
-    else if(fdata->site_mode!=0)
-        return -EINVAL;
+    ctrl_tmp &= ~(mask << shift);
+    ctrl_tmp |= (val & mask) << shift;
 
-    if (count > DMA_BUF_COUNT*DMA_BUF_SIZE) return -EINVAL;
+    board->regs.conv_trg = ctrl_tmp;
+    iowrite32(ctrl_tmp, board->bar0 + PICO_ADDR + PICO_CONV_TRG);
+    return ctrl_tmp;
+}
 
-    spin_lock_irq(&board->dma_queue.lock);
+static
+long char_acq_config(struct board_data *board, struct pico_acq_config __user *arg)
+{
+    struct pico_acq_config cfg;
+    long ret = 0;
 
-	if(board->read_in_progress) {
-        spin_unlock_irq(&board->dma_queue.lock);
-        dev_dbg(&board->pci_dev->dev, "  read(), concurrent read()s not allowed\n");
-		return -EIO;
-	}
-	board->read_in_progress = 1;
-
-	/* start dma transfer */
-	i = 0;
-	tmp_count = count;
-	dma_enable(board, 0);
-	while (tmp_count > DMA_BUF_SIZE) {
-		dma_push(board, (uint32_t)board->dma_buf[i++], DMA_BUF_SIZE, 0);
-		tmp_count -= DMA_BUF_SIZE;
-	}
-	dma_push(board, (uint32_t)board->dma_buf[i], tmp_count, 1);
-	mb();
-	dma_enable(board, 1);
+    if(copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
 
-    if (likely(board->irqmode!=dmac_irq_poll)) {
-        rc = wait_event_interruptible_locked_irq(board->dma_queue, board->dma_irq_flag!=0);
+    /* validate everything before changing anything */
+    if(cfg.version!=PICO_ACQ_CONFIG_VERSION || (cfg.mask&~PICO_CFG_ALL) || cfg.reserved)
+        return -EINVAL;
+    if((cfg.mask&PICO_CFG_RANGE) && cfg.range>0xff)
+        return -EINVAL;
+    if((cfg.mask&PICO_CFG_FSAMP) && !pico_fsamp_valid(cfg.fsamp))
+        return -EINVAL;
+    if((cfg.mask&PICO_CFG_TRG) && (cfg.trg_mode>BOTH_EDGE || cfg.trg_ch_sel>0x7))
+        return -EINVAL;
+    if((cfg.mask&PICO_CFG_GATE_MUX) && cfg.gate_mux>MUX_TRG_MASK)
+        return -EINVAL;
+    if((cfg.mask&PICO_CFG_CONV_MUX) && cfg.conv_mux>MUX_CONV_MASK)
+        return -EINVAL;
 
-    } else {
-        const unsigned long twait = msecs_to_jiffies(1);
-        do {
-            spin_unlock_irq(&board->dma_queue.lock);
-            /* must unlock for call to amc_isr() as spin locks aren't recursive */
-            if(amc_isr(board->pci_dev->irq, board)==IRQ_NONE)
-                rc = wait_event_interruptible_timeout(board->dma_queue, board->dma_irq_flag!=0, twait);
-            else
-                rc = 0;
-            spin_lock_irq(&board->dma_queue.lock);
-            /* continue while no "IRQ" signaled, and wait not interrupted */
-        } while(board->dma_irq_flag==0 && rc>=0);
-        if(rc>0) rc=0;
-    }
-    /*
-     * dma_irq_flag==1 && rc==0 is normal completion
-     * rc==-ERESTARTSYS is user abort
-     * other cases not to happen, but are treated as -ECANCELED
-     */
+    if(mutex_lock_interruptible(&board->reg_lock))
+        return -EINTR;
 
-    cond = board->dma_irq_flag;
-    board->dma_irq_flag = 0;
-	board->read_in_progress = 0;
-    dev_dbg(&board->pci_dev->dev, "read() wait complete w/ rc=%d cond=%d\n", rc, cond);
-
-	if (rc != 0 || cond!=1) { /* interrupted or aborted */
-		if(cond!=1) rc = -ECANCELED;
-		/* reset DMA engine */
-		dma_reset(board);
-        board->dma_bytes_trans = 0;
+    if(cfg.mask) {
+        /* claim the acquisition, like BIST(), so no arming while we change settings */
+        spin_lock_irq(&board->dma_queue.lock);
+        if(board->read_in_progress || board->dma_pushed!=board->dma_completed)
+            ret = -EBUSY; /* don't change settings under an acquisition in flight */
+        else
+            board->read_in_progress = 1;
         spin_unlock_irq(&board->dma_queue.lock);
+    }
 
-        dev_dbg(&board->pci_dev->dev, "  read(): interrupt failed: %d\n", rc);
-		return rc;
-	} else {
+    if(!ret && cfg.mask) {
+        if(cfg.mask&PICO_CFG_RANGE)
+            pico_write_range(board, cfg.range);
+        if(cfg.mask&PICO_CFG_FSAMP)
+            pico_write_fsamp(board, cfg.fsamp);
+        if(cfg.mask&PICO_CFG_TRG)
+            pico_write_trg(board, *(uint32_t*)&cfg.trg_limit, cfg.trg_nr_samp,
+                           cfg.trg_ch_sel, cfg.trg_mode);
+        if(cfg.mask&PICO_CFG_RING_BUF)
+            pico_write_ring_buf(board, cfg.ring_buf);
+        if(cfg.mask&PICO_CFG_GATE_MUX)
+            pico_write_conv_trg(board, MUX_TRG_MASK, MUX_TRG_SHIFT, cfg.gate_mux);
+        if(cfg.mask&PICO_CFG_CONV_MUX)
+            pico_write_conv_trg(board, MUX_CONV_MASK, MUX_CONV_SHIFT, cfg.conv_mux);
+        pico_config_publish(board);
+
+        spin_lock_irq(&board->dma_queue.lock);
+        board->read_in_progress = 0;
         spin_unlock_irq(&board->dma_queue.lock);
+    }
 
-		i = 0;
-		tmp_count = count;
-        dev_dbg(&board->pci_dev->dev, "  read(): returned from sleep\n");
-		rc = 0;
-		while (tmp_count > DMA_BUF_SIZE && rc==0) {
-			rc = copy_to_user(buf + DMA_BUF_SIZE*i,
-					board->kernel_mem_buf[i], DMA_BUF_SIZE);
-			tmp_count -= DMA_BUF_SIZE;
-			/* sometimes the DMA done interrupt comes even though nothing has been
-			 * transfered.  Fill our buffer with a test pattern so that this is more
-			 * obvious.
-			 */
-			memset(board->kernel_mem_buf[i], 0xf0, DMA_BUF_SIZE);
-			i++;
-		}
-		if(rc==0) {
-			rc = copy_to_user(buf + DMA_BUF_SIZE*i,
-							board->kernel_mem_buf[i], tmp_count);
-			memset(board->kernel_mem_buf[i], 0xf0, tmp_count);
-		}
-
-		if(rc) return rc;
-	}
+    /* return all current settings, leaving mask as given */
+    {
+        uint32_t mask = cfg.mask;
+        pico_get_config(board, &cfg);
+        cfg.mask = mask;
+    }
 
-	*pos += count;
+    mutex_unlock(&board->reg_lock);
 
-	return count;
+    if(!ret && copy_to_user(arg, &cfg, sizeof(cfg)))
+        ret = -EFAULT;
+    return ret;
 }
 
 /* all possible ioctl() value types */
@@ -222,8 +1228,82 @@ union ioctl_value {
     uint8_t u8;
     uint32_t u32;
     struct trg_ctrl trg;
+    struct pico_shared_info shared;
 };
 
+/* Configuration register ioctl()s.
+ * Returns -ENOIOCTLCMD for others, to be handled under dma_queue.lock
+ */
+static
+long char_reg_ioctl(struct board_data *board, unsigned int cmd, union ioctl_value *uval)
+{
+    switch(cmd) {
+    case SET_RANGE:
+    case GET_RANGE:
+    case SET_FSAMP:
+    case GET_FSAMP:
+    case SET_TRG:
+    case SET_RING_BUF:
+    case SET_GATE_MUX:
+    case SET_CONV_MUX:
+    case RESYNC_REGS:
+        break;
+    default:
+        return -ENOIOCTLCMD;
+    }
+
+    if(mutex_lock_interruptible(&board->reg_lock))
+        return -EINTR;
+
+    /* registers are written through, and read from, board->regs */
+    if(cmd==RESYNC_REGS)
+        pico_regs_resync(board);
+
+    switch(cmd) {
+    case SET_RANGE:
+        pico_write_range(board, uval->u8);
+        break;
+
+    case GET_RANGE:
+        uval->u8 = board->regs.control & 0xFF;
+        break;
+
+    case SET_FSAMP:
+        uval->u32 = pico_write_fsamp(board, uval->u32);
+        break;
+
+    case GET_FSAMP:
+        uval->u32 = PICO_CLK_FREQ / (board->regs.conv_gen + 1);
+        break;
+
+    case SET_TRG:
+        uval->u32 = pico_write_trg(board, *(uint32_t *)&uval->trg.limit, uval->trg.nr_samp,
+                                   uval->trg.ch_sel, uval->trg.mode);
+        break;
+
+    case SET_RING_BUF:
+        pico_write_ring_buf(board, uval->u32);
+        break;
+
+    case SET_GATE_MUX:
+        uval->u32 = pico_write_conv_trg(board, MUX_TRG_MASK, MUX_TRG_SHIFT, uval->u32);
+        break;
+
+    case SET_CONV_MUX:
+        uval->u32 = pico_write_conv_trg(board, MUX_CONV_MASK, MUX_CONV_SHIFT, uval->u32);
+        break;
+    }
+
+    if(cmd!=GET_RANGE && cmd!=GET_FSAMP && cmd!=RESYNC_REGS)
+        pico_config_publish(board);
+
+    mutex_unlock(&board->reg_lock);
+
+    if(cmd==RESYNC_REGS)
+        pico_ddr_resync(board);
+    return 0;
+}
+
 static
 long char_ioctl(
 	struct file *filp,
@@ -257,15 +1337,18 @@ long char_ioctl(
     case SET_RANGE:
         ret = 0;
 		break;
-    case SET_FSAMP:	{
-		uint32_t scaler = PICO_CLK_FREQ / uval.u32 - 1;
-		if ((uval.u32 > PICO_ADC_MAX_FREQ) || (scaler > (PICO_CONV_MAX-1))){
+    case SET_FSAMP:
+		if (!pico_fsamp_valid(uval.u32)){
 			return -EINVAL;
 		} else {
 			ret = 0;
 		}
 		break;
-	}
+    case SET_ACQ_CONFIG:
+        return char_acq_config(board, (struct pico_acq_config __user *)arg);
+    case SET_READ_HEADER:
+        fdata->read_header = !!uval.u32;
+        return 0;
     case SET_TRG:
     case SET_RING_BUF:
 	case SET_GATE_MUX:
@@ -273,9 +1356,60 @@ long char_ioctl(
 	case GET_RANGE:
 	case GET_FSAMP:
 	case GET_B_TRANS:
+	case GET_STREAM_OVERRUNS:
+	case GET_SHARED_INFO:
 	case ABORT_READ:
+	case RESYNC_REGS:
 		ret = 0;
 		break;
+    case GET_STATS: {
+        struct pico_stats stats;
+        stats.bytes = atomic64_read(&board->stat_bytes);
+        stats.reads = atomic64_read(&board->stat_reads);
+        stats.aborts = atomic64_read(&board->stat_aborts);
+        stats.cancelled = atomic64_read(&board->stat_cancelled);
+        stats.fifo_runaway = atomic64_read(&board->stat_fifo_runaway);
+        stats.empty_done = atomic64_read(&board->stat_empty_done);
+        stats.short_xfer = atomic64_read(&board->stat_short_xfer);
+        return copy_to_user((void*)arg, &stats, sizeof(stats)) ? -EFAULT : 0;
+    }
+    case SET_READ_MODE:
+        if(uval.u32!=READ_MODE_ONESHOT && uval.u32!=READ_MODE_STREAM
+                && uval.u32!=READ_MODE_DIRECT && uval.u32!=READ_MODE_SHARED)
+            return -EINVAL;
+        ret = 0;
+        break;
+    case GET_DMA_BUF_INFO: {
+        struct pico_dma_info info;
+        info.count = DMA_BUF_COUNT;
+        info.length = DMA_BUF_SIZE;
+        return copy_to_user((void*)arg, &info, sizeof(info)) ? -EFAULT : 0;
+    }
+    case DMA_DQBUF:
+        if(fdata->read_mode!=READ_MODE_STREAM)
+            return -EINVAL;
+        return char_dqbuf(fdata, (struct pico_dma_buf __user *)arg,
+                          filp->f_flags&O_NONBLOCK);
+    case MAP_USER_BUF:
+        return char_map_user_buf(fdata, (const struct pico_user_buf __user *)arg);
+    case UNMAP_USER_BUF:
+        return char_unmap_user_buf(fdata);
+#ifdef CONFIG_AMC_PICO_FRIB
+    case FRIB_REG_BATCH:
+        if(board->site!=USER_SITE_FRIB || fdata->site_mode!=1)
+            return -EINVAL;
+        return frib_reg_batch(board, (struct pico_reg_batch __user *)arg);
+#endif
+    case ARM_READ:
+        if(fdata->read_mode==READ_MODE_DIRECT)
+            return -EINVAL;
+        if((fdata->read_mode==READ_MODE_ONESHOT || fdata->read_mode==READ_MODE_SHARED) &&
+                (uval.u32==0 || uval.u32 > DMA_BUF_COUNT*DMA_BUF_SIZE))
+            return -EINVAL;
+        ret = 0;
+        break;
+    case DMA_QBUF:
+        return char_qbuf(fdata, uval.u32);
 	case GET_VERSION:
         /* Versions:
          *  0 - implied by errno==EINVAL
@@ -284,6 +1418,15 @@ long char_ioctl(
          *      Changed all others.
          *  3 - Changed GET_FSAMP and SET_FSAMP to use frequency as
          *      a parameter
+         *  4 - Added SET_READ_MODE, GET_STREAM_OVERRUNS,
+         *      mmap(), GET_DMA_BUF_INFO, DMA_DQBUF, DMA_QBUF,
+         *      ARM_READ, poll() and O_NONBLOCK,
+         *      READ_MODE_DIRECT, MAP_USER_BUF, UNMAP_USER_BUF,
+         *      FRIB_SITE_MODE_EVENTS, GET_STATS,
+         *      DDR_LOCK_PAGE, DDR_UNLOCK_PAGE, FRIB_REG_BATCH,
+         *      RESYNC_REGS, SET_ACQ_CONFIG,
+         *      READ_MODE_SHARED, GET_SHARED_INFO,
+         *      PICO_STATUS_MMAP_OFFSET, SET_READ_HEADER
          */
         return put_user(GET_VERSION_CURRENT, (uint32_t*)arg);
     case GET_SITE_ID:
@@ -303,7 +1446,7 @@ long char_ioctl(
         if(0) {}
 #ifdef CONFIG_AMC_PICO_FRIB
         else if(board->site==USER_SITE_FRIB) {
-            if(uval.u32>2) return -EINVAL;
+            if(uval.u32>FRIB_SITE_MODE_EVENTS) return -EINVAL;
         }
 #endif
         else if(uval.u32!=0) return -EINVAL;
@@ -317,96 +1460,74 @@ long char_ioctl(
 
     if(ret) return ret;
 
-    /* locking here to protect RMW register operations.
-     * Use dma_queue.lock for convinience
+    /* configuration registers have their own sleeping lock,
+     * so they don't hold off amc_isr()
      */
-    spin_lock_irq(&board->dma_queue.lock); /* enter critical section, can't sleep */
-
-	switch (cmd) {
-    case SET_RANGE: {
-        uint32_t control;
-		control = ioread32(board->bar0);
-		control &= ~0xFFUL;
-        control |= uval.u8;
-		iowrite32(control, board->bar0);
-		control = ioread32(board->bar0);
-		break;
+    ret = char_reg_ioctl(board, cmd, &uval);
+    if(ret!=-ENOIOCTLCMD) {
+        if(ret) return ret;
+        goto copyout;
     }
-	case GET_RANGE:
-        uval.u8 = ioread32(board->bar0) & 0xFF;
-		break;
-
-	case SET_FSAMP: {
-        uint32_t scaler = PICO_CLK_FREQ / uval.u32 - 1;
-        iowrite32(scaler, board->bar0 + PICO_CONV_GEN);
-        uval.u32 = ioread32(board->bar0 + PICO_CONV_GEN);
-		break;
-	}
+    ret = 0;
 
-	case GET_FSAMP: {
-        uint32_t scaler = ioread32(board->bar0 + PICO_CONV_GEN);
-        uval.u32 = PICO_CLK_FREQ / (scaler + 1);
-		break;
-	}
+    /* dma_queue.lock protects acquisition state shared with amc_isr() */
+    spin_lock_irq(&board->dma_queue.lock); /* enter critical section, can't sleep */
 
+	switch (cmd) {
 	case GET_B_TRANS:
         uval.u32 = board->dma_bytes_trans;
 		break;
 
-    case SET_TRG: {
-        uint32_t ctrl_tmp;
-        iowrite32(*(uint32_t *)&uval.trg.limit,
-			board->bar0 + PICO_ADDR + TRG_OFFS_LIMIT);
-        iowrite32(uval.trg.nr_samp,
-			board->bar0 + PICO_ADDR + TRG_OFFS_NRSAMP);
-
-		ctrl_tmp = ioread32(board->bar0 + PICO_ADDR + TRG_OFFS_CTRL);
-
-		/* change the trigger edge */
-		ctrl_tmp &= ~(0x3);
-        ctrl_tmp |= uval.trg.mode;
-
-		/* change the channel bits */
-		ctrl_tmp &= ~(0x7 << TRG_CTRL_CH_SHIFT);
-        ctrl_tmp |= uval.trg.ch_sel << TRG_CTRL_CH_SHIFT;
-
-		iowrite32(ctrl_tmp, board->bar0 + PICO_ADDR + TRG_OFFS_CTRL);
-        uval.u32 = ioread32(board->bar0 + PICO_ADDR + TRG_OFFS_CTRL);
-		break;
-    }
-	case SET_RING_BUF:
-        iowrite32(uval.u32,
-			board->bar0 + PICO_ADDR + RING_BUFF_OFFS_DELAY);
-		break;
-
-    case SET_GATE_MUX: {
-        uint32_t ctrl_tmp;
-        uval.u32 &= MUX_TRG_MASK;
-        uval.u32 <<= MUX_TRG_SHIFT;
-
-		ctrl_tmp = ioread32(board->bar0 + PICO_ADDR + PICO_CONV_TRG);
-		ctrl_tmp &= ~(MUX_TRG_MASK << MUX_TRG_SHIFT);
-        ctrl_tmp |= uval.u32;
-
-		iowrite32(ctrl_tmp, board->bar0 + PICO_ADDR + PICO_CONV_TRG);
-        uval.u32 = ioread32(board->bar0 + PICO_ADDR + PICO_CONV_TRG);
-		break;
-    }
-    case SET_CONV_MUX: {
-        uint32_t ctrl_tmp;
-        uval.u32 &= MUX_CONV_MASK;
-        uval.u32 <<= MUX_CONV_SHIFT;
-
-		ctrl_tmp = ioread32(board->bar0 + PICO_ADDR + PICO_CONV_TRG);
-		ctrl_tmp &= ~(MUX_CONV_MASK << MUX_CONV_SHIFT);
-        ctrl_tmp |= uval.u32;
+    case GET_STREAM_OVERRUNS:
+        uval.u32 = board->ring_overruns;
+        break;
+
+    case SET_READ_MODE:
+        if(uval.u32==fdata->read_mode) {
+            break; /* no-op */
+        } else if(fdata->shared_reading) {
+            /* would leave the waiting read() re-arming for no reader */
+            ret = -EBUSY;
+            break;
+        } else if(board->acq_owner!=fdata) {
+            /* no-op */
+        } else if(board->acq_busy) {
+            ret = -EBUSY;
+            break;
+        } else {
+            pico_acq_stop(board);
+        }
+        if(fdata->read_mode==READ_MODE_SHARED)
+            pico_shared_leave(board);
+        fdata->read_mode = uval.u32;
+        if(fdata->read_mode==READ_MODE_SHARED) {
+            /* only see acquisitions completed from now on */
+            board->shared_readers++;
+            fdata->shared_seq = board->shared_seq;
+            fdata->shared_missed = 0;
+        }
+        break;
+
+    case GET_SHARED_INFO:
+        uval.shared.seq = fdata->shared_seq;
+        uval.shared.missed = fdata->shared_missed;
+        break;
+
+    case ARM_READ:
+        if(board->read_in_progress)
+            ret = -EBUSY;
+        else if(fdata->read_mode==READ_MODE_SHARED)
+            pico_shared_arm(board, uval.u32);
+        else if(fdata->read_mode==READ_MODE_STREAM)
+            pico_ring_arm(board, fdata, 0);
+        else
+            pico_ring_arm(board, fdata, uval.u32);
+        break;
 
-		iowrite32(ctrl_tmp, board->bar0 + PICO_ADDR + PICO_CONV_TRG);
-        uval.u32 = ioread32(board->bar0 + PICO_ADDR + PICO_CONV_TRG);
-		break;
-    }
 	case ABORT_READ:
         /* abort in progress DMA waiter */
+        atomic64_inc(&board->stat_aborts);
+        board->shared_aborts++;
         board->dma_irq_flag = 2;
         wake_up_locked(&board->dma_queue);
 
@@ -421,12 +1542,13 @@ long char_ioctl(
     if(cmd==ABORT_READ) {
         /* abort any waiting for capture buffer */
         spin_lock_irq(&board->capture_queue.lock);
-        board->capture_ready = 2;
+        board->capture_abort = 1;
         wake_up_locked(&board->capture_queue);
         spin_unlock_irq(&board->capture_queue.lock);
     }
 #endif
 
+copyout:
     if(_IOC_DIR(cmd)&_IOC_READ) {
         ret = copy_to_user((void*)arg, &uval, tocpy);
         if(ret) return ret;
@@ -487,6 +1609,104 @@ loff_t char_llseek(struct file *filp, loff_t pos, int whence)
 #endif
 }
 
+static
+unsigned int char_poll(struct file *filp, poll_table *wait)
+{
+    struct file_data *fdata = (struct file_data *)filp->private_data;
+    struct board_data *board = fdata->board;
+    unsigned int mask = 0;
+
+#ifdef CONFIG_AMC_PICO_FRIB
+    if(board->site==USER_SITE_FRIB && fdata->site_mode>=2) {
+        poll_wait(filp, &board->capture_queue, wait);
+        spin_lock_irq(&board->capture_queue.lock);
+        if(board->capture_head!=board->capture_tail || board->capture_abort)
+            mask |= POLLIN|POLLRDNORM;
+        spin_unlock_irq(&board->capture_queue.lock);
+        return mask;
+    }
+#endif
+    if(fdata->site_mode!=0)
+        return POLLIN|POLLRDNORM;
+
+    poll_wait(filp, &board->dma_queue, wait);
+    /* in polled mode, nothing wakes dma_queue while poll() sleeps */
+    pico_poll_isr(board);
+
+    spin_lock_irq(&board->dma_queue.lock);
+    if(fdata->read_mode==READ_MODE_SHARED) {
+        /* readable when an acquisition we haven't seen is available,
+         * or is complete and waiting for a read() to publish it.
+         */
+        if(board->shared_armed ? pico_oneshot_done(board)
+                               : board->shared_valid && board->shared_seq!=fdata->shared_seq)
+            mask |= POLLIN|POLLRDNORM;
+
+    } else if(board->acq_owner==fdata) {
+        /* readable when armed acquisition is complete, or new stream data */
+        if(board->dma_irq_flag==2)
+            mask |= POLLIN|POLLRDNORM;
+        else if(fdata->read_mode==READ_MODE_STREAM && board->dma_completed!=board->ring_seq)
+            mask |= POLLIN|POLLRDNORM;
+        else if(fdata->read_mode!=READ_MODE_STREAM && pico_oneshot_done(board))
+            mask |= POLLIN|POLLRDNORM;
+
+    } else if(!board->read_in_progress && board->dma_irq_flag==2) {
+        /* pending ABORT_READ, next read() returns immediately */
+        mask |= POLLIN|POLLRDNORM;
+    }
+    spin_unlock_irq(&board->dma_queue.lock);
+
+    return mask;
+}
+
+/* Map one DMA buffer read-only.
+ * The mmap() offset selects the buffer as index*DMA_BUF_SIZE
+ */
+static
+int char_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct file_data *fdata = (struct file_data *)filp->private_data;
+    struct board_data *board = fdata->board;
+    unsigned long offset = vma->vm_pgoff<<PAGE_SHIFT,
+                  len = vma->vm_end-vma->vm_start;
+    unsigned idx = offset/DMA_BUF_SIZE;
+    int ret;
+
+    dev_dbg(&board->pci_dev->dev, "mmap(%lu, %lu)\n", offset, len);
+
+    if(vma->vm_flags&VM_WRITE)
+        return -EPERM;
+
+    if(offset==PICO_STATUS_MMAP_OFFSET) {
+        /* status page */
+        if(len>PAGE_SIZE)
+            return -EINVAL;
+        vma->vm_flags &= ~VM_MAYWRITE;
+        return remap_pfn_range(vma, vma->vm_start,
+                               virt_to_phys(board->status)>>PAGE_SHIFT,
+                               len, vma->vm_page_prot);
+    }
+
+    if(offset%DMA_BUF_SIZE || idx>=DMA_BUF_COUNT || len>DMA_BUF_SIZE)
+        return -EINVAL;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+#if LINUX_VERSION_CODE>=KERNEL_VERSION(3,6,0)
+    /* offset within this buffer is zero */
+    vma->vm_pgoff = 0;
+    ret = dma_mmap_coherent(&board->pci_dev->dev, vma, board->kernel_mem_buf[idx],
+                            board->dma_buf[idx], len);
+    vma->vm_pgoff = offset>>PAGE_SHIFT;
+#else
+    ret = remap_pfn_range(vma, vma->vm_start,
+                          virt_to_phys(board->kernel_mem_buf[idx])>>PAGE_SHIFT,
+                          len, vma->vm_page_prot);
+#endif
+    return ret;
+}
+
 const struct file_operations amc_pico_fops = {
 	.owner		= THIS_MODULE,
 	.open		= char_open,
@@ -494,11 +1714,24 @@ const struct file_operations amc_pico_fops = {
 	.read		= char_read,
     .write      = char_write,
     .llseek     = char_llseek,
+    .poll       = char_poll,
+    .mmap       = char_mmap,
 	.unlocked_ioctl = char_ioctl
 };
 
 #ifdef CONFIG_AMC_PICO_FRIB
 
+/* configuration registers, or DDR_SELECT, may have been written.
+ * See pico_regs_resync() and pico_ddr_resync()
+ */
+static void frib_regs_touched(struct board_data *board)
+{
+    mutex_lock(&board->reg_lock);
+    pico_regs_resync(board);
+    mutex_unlock(&board->reg_lock);
+    pico_ddr_resync(board);
+}
+
 static ssize_t frib_write_reg(struct board_data *board,
                              const char __user *buf,
                              size_t count,
@@ -526,6 +1759,8 @@ static ssize_t frib_write_reg(struct board_data *board,
         iowrite32(val, board->bar0 + offset);
     }
 
+    frib_regs_touched(board);
+
     if(!ret) ret=count;
     return ret;
     /* *pos not updated */
@@ -559,6 +1794,104 @@ static ssize_t frib_read_reg(struct board_data *board,
     /* *pos not updated */
 }
 
+static long frib_reg_poll(struct board_data *board,
+                          struct pico_reg_op *rop,
+                          uint32_t timeout_us)
+{
+    unsigned long deadline = jiffies + usecs_to_jiffies(timeout_us) + 1;
+
+    for(;;) {
+        uint32_t val = ioread32(board->bar0 + rop->offset);
+
+        if((val&rop->mask)==(rop->value&rop->mask)) {
+            rop->value = val;
+            return 0;
+        }
+        if(time_after(jiffies, deadline)) {
+            rop->value = val;
+            return -ETIMEDOUT;
+        }
+        /* not restartable as earlier ops may have side-effects */
+        if(signal_pending(current))
+            return -EINTR;
+        usleep_range(10, 50);
+    }
+}
+
+static long frib_reg_batch(struct board_data *board,
+                           struct pico_reg_batch __user *arg)
+{
+    long ret = 0;
+    struct pico_reg_batch req;
+    struct pico_reg_op *rops;
+    struct pico_reg_op __user *uops;
+    size_t bar0len = pci_resource_len(board->pci_dev, 0);
+    uint32_t i;
+
+    if(copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+
+    if(req.count==0)
+        return 0;
+    if(req.count>PICO_REG_BATCH_MAX || req.ops!=(unsigned long)req.ops)
+        return -EINVAL;
+
+    uops = (struct pico_reg_op __user *)(unsigned long)req.ops;
+
+    rops = kmalloc(req.count*sizeof(*rops), GFP_KERNEL);
+    if(!rops)
+        return -ENOMEM;
+
+    if(copy_from_user(rops, uops, req.count*sizeof(*rops))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* validate all before touching any register */
+    for(i=0; i<req.count; i++) {
+        if(rops[i].offset%4 || rops[i].offset>=bar0len || rops[i].op>PICO_REG_POLL) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    dev_dbg(&board->pci_dev->dev, "reg batch %u ops", (unsigned)req.count);
+
+    for(i=0; !ret && i<req.count; i++) {
+        struct pico_reg_op *rop = &rops[i];
+        void __iomem *reg = board->bar0 + rop->offset;
+
+        switch(rop->op) {
+        case PICO_REG_READ:
+            rop->value = ioread32(reg);
+            break;
+        case PICO_REG_WRITE:
+            iowrite32(rop->value, reg);
+            break;
+        case PICO_REG_RMW:
+            rop->value = (ioread32(reg)&~rop->mask) | (rop->value&rop->mask);
+            iowrite32(rop->value, reg);
+            break;
+        case PICO_REG_POLL:
+            ret = frib_reg_poll(board, rop, req.timeout_us);
+            break;
+        }
+    }
+    /* i is the number of completed ops, or one past a failed PICO_REG_POLL */
+    if(ret)
+        i--;
+
+    frib_regs_touched(board);
+
+    if(copy_to_user(uops, rops, req.count*sizeof(*rops))
+            || put_user(i, &arg->count))
+        ret = -EFAULT;
+
+out:
+    kfree(rops);
+    return ret;
+}
+
 static ssize_t frib_read_capture(struct board_data *board,
                                  char __user *buf,
                                  size_t count,
@@ -581,22 +1914,89 @@ static ssize_t frib_read_capture(struct board_data *board,
     if(count > board->capture_length-offset)
         count = board->capture_length-offset;
 
+    if(mutex_lock_interruptible(&board->capture_read_lock))
+        return -ERESTARTSYS;
+
     spin_lock_irq(&board->capture_queue.lock);
 
-    ret = wait_event_interruptible_locked_irq(board->capture_queue, board->capture_ready!=0);
+    ret = wait_event_interruptible_locked_irq(board->capture_queue,
+                board->capture_head!=board->capture_tail || board->capture_abort);
 
-    if(!ret && board->capture_ready!=1)
+    if(!ret && board->capture_abort)
         ret = -ECANCELED;
-    board->capture_ready = 0;
+    else if(!ret)
+        board->capture_tail = board->capture_head-1; /* only the latest event */
+    board->capture_abort = 0;
 
     spin_unlock_irq(&board->capture_queue.lock);
 
-    if(ret) return ret;
+    /* slot capture_tail is not touched by amc_isr_thread() until released */
+    if(!ret) {
+        const char *src = (const char*)(frib_capture_slot(board, board->capture_tail)+1) + offset;
+        ret = copy_to_user(buf, src, count) ? -EFAULT : count;
 
-    ret = copy_to_user(buf, board->capture_buf, count);
-    if(!ret) ret=count;
+        spin_lock_irq(&board->capture_queue.lock);
+        board->capture_tail++;
+        spin_unlock_irq(&board->capture_queue.lock);
+    }
+
+    mutex_unlock(&board->capture_read_lock);
     return ret;
     /* *pos not updated */
 }
 
+/* Return as many whole events as fit in count bytes */
+static ssize_t frib_read_events(struct board_data *board,
+                                char __user *buf,
+                                size_t count,
+                                int nonblock)
+{
+    size_t esize = frib_capture_slot_size(board);
+    unsigned first, n, i;
+    ssize_t ret = 0;
+
+    if(!board->capture_nslots || count<esize) return -EINVAL;
+
+    if(mutex_lock_interruptible(&board->capture_read_lock))
+        return -ERESTARTSYS;
+
+    spin_lock_irq(&board->capture_queue.lock);
+
+    if(nonblock && board->capture_head==board->capture_tail && !board->capture_abort)
+        ret = -EAGAIN;
+    else
+        ret = wait_event_interruptible_locked_irq(board->capture_queue,
+                    board->capture_head!=board->capture_tail || board->capture_abort);
+
+    if(!ret && board->capture_abort)
+        ret = -ECANCELED;
+    board->capture_abort = 0;
+
+    first = board->capture_tail;
+    n = board->capture_head-first;
+    if(n > count/esize)
+        n = count/esize;
+
+    spin_unlock_irq(&board->capture_queue.lock);
+
+    if(ret) {
+        mutex_unlock(&board->capture_read_lock);
+        return ret;
+    }
+
+    /* slots [first, first+n) are not touched by amc_isr_thread() until released */
+    for(i=0; i<n && !ret; i++) {
+        if(copy_to_user(buf+i*esize, frib_capture_slot(board, first+i), esize))
+            ret = -EFAULT;
+    }
+
+    spin_lock_irq(&board->capture_queue.lock);
+    board->capture_tail += n;
+    spin_unlock_irq(&board->capture_queue.lock);
+
+    mutex_unlock(&board->capture_read_lock);
+
+    return ret ? ret : n*esize;
+}
+
 #endif
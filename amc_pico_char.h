@@ -28,17 +28,22 @@
 #ifndef AMC_PICO_CHAR_H_
 #define AMC_PICO_CHAR_H_
 
+#include <linux/version.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/cdev.h>
 #include <linux/pci.h>
 #include <linux/sched.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/dma-mapping.h>
 #include <asm/uaccess.h>
 
 #include "amc_pico_internal.h"
 #include "amc_pico_regs.h"
 #include "amc_pico_dma.h"
+#include "amc_pico_ubuf.h"
 
 extern const struct file_operations amc_pico_fops;
 extern const struct file_operations amc_ddr_fops;
@@ -47,6 +52,22 @@ struct file_data {
     struct board_data *board;
 
     unsigned site_mode;
+    unsigned read_mode;
+
+    /* buffer from MAP_USER_BUF, or NULL */
+    struct pico_ubuf *ubuf;
+
+    /* READ_MODE_SHARED, see struct pico_shared_info.
+     * Protected by dma_queue.lock
+     */
+    uint32_t shared_seq;
+    uint32_t shared_missed;
+    /* read()s waiting in char_read_shared(), which hold off SET_READ_MODE */
+    unsigned shared_reading;
+
+    /* SET_READ_HEADER, and the last acquisition read() */
+    unsigned read_header;
+    struct pico_read_header hdr;
 };
 
 #endif /* AMC_PICO_CHAR_H_ */
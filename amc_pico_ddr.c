@@ -1,6 +1,30 @@
 
 #include "amc_pico_char.h"
 
+/* 1 - move DDR through a bounce buffer with memcpy_fromio()/memcpy_toio()
+ * 0 - move one word at a time (original method, for comparison)
+ */
+static
+uint dmac_ddr_burst = 1;
+module_param_named(ddr_burst, dmac_ddr_burst, uint, 0644);
+
+/* read()/write() of the whole DDR are implemented through read_iter()/write_iter()
+ * so that readv()/writev() take ddr_lock only once.
+ */
+#if LINUX_VERSION_CODE>=KERNEL_VERSION(3,19,0)
+#  define PICO_DDR_ITER
+#endif
+
+/* Change DDR_SELECT only if needed.  Call with ddr_lock held */
+static
+void ddr_select(struct board_data *board, uint32_t page)
+{
+    if(board->ddr_cur_page==page)
+        return;
+    iowrite32(page, board->bar0+DDR_SELECT);
+    board->ddr_cur_page = page;
+}
+
 static
 int char_ddr_open(struct inode *inode, struct file *file)
 {
@@ -41,12 +65,68 @@ int char_ddr_release(struct inode *inode, struct file *filp)
 
     dev_dbg(&board->pci_dev->dev, "%s()\n", __FUNCTION__);
 
+    /* any mmap() is gone by now */
+    mutex_lock(&board->ddr_lock);
+    spin_lock(&board->ddr_map_lock);
+    if(board->ddr_owner==filp)
+        board->ddr_owner = NULL;
+    spin_unlock(&board->ddr_map_lock);
+    mutex_unlock(&board->ddr_lock);
+
     kobject_put(&board->kobj);
     kobject_put(&board->cdev_ddr.kobj);
     module_put(THIS_MODULE);
     return 0;
 }
 
+static
+long char_ddr_lock_page(struct file *filp, uint32_t page)
+{
+    struct board_data *board = (struct board_data *)filp->private_data;
+    long ret = 0;
+
+    if(page>DDR_SELECT_MASK)
+        return -EINVAL;
+
+    if(mutex_lock_interruptible(&board->ddr_lock))
+        return -EINTR;
+
+    if(board->ddr_owner && board->ddr_owner!=filp) {
+        ret = -EBUSY;
+    } else {
+        spin_lock(&board->ddr_map_lock);
+        board->ddr_owner = filp;
+        spin_unlock(&board->ddr_map_lock);
+        board->ddr_page = page;
+        ddr_select(board, page);
+    }
+
+    mutex_unlock(&board->ddr_lock);
+    return ret;
+}
+
+static
+long char_ddr_unlock_page(struct file *filp)
+{
+    struct board_data *board = (struct board_data *)filp->private_data;
+    long ret = 0;
+
+    if(mutex_lock_interruptible(&board->ddr_lock))
+        return -EINTR;
+
+    spin_lock(&board->ddr_map_lock);
+    if(board->ddr_owner!=filp)
+        ret = -EINVAL;
+    else if(board->ddr_maps)
+        ret = -EBUSY;
+    else
+        board->ddr_owner = NULL;
+    spin_unlock(&board->ddr_map_lock);
+
+    mutex_unlock(&board->ddr_lock);
+    return ret;
+}
+
 static
 long char_ddr_ioctl(
     struct file *filp,
@@ -57,11 +137,105 @@ long char_ddr_ioctl(
     switch(cmd) {
     case GET_VERSION:
         return put_user(GET_VERSION_CURRENT, (uint32_t*)arg);
+    case DDR_LOCK_PAGE: {
+        uint32_t page;
+        if(get_user(page, (uint32_t*)arg))
+            return -EFAULT;
+        return char_ddr_lock_page(filp, page);
+    }
+    case DDR_UNLOCK_PAGE:
+        return char_ddr_unlock_page(filp);
     default:
         return -ENOTTY;
     }
 }
 
+static
+void char_ddr_vm_open(struct vm_area_struct *vma)
+{
+    struct board_data *board = (struct board_data *)vma->vm_file->private_data;
+
+    spin_lock(&board->ddr_map_lock);
+    board->ddr_maps++;
+    spin_unlock(&board->ddr_map_lock);
+}
+
+static
+void char_ddr_vm_close(struct vm_area_struct *vma)
+{
+    struct board_data *board = (struct board_data *)vma->vm_file->private_data;
+
+    spin_lock(&board->ddr_map_lock);
+    board->ddr_maps--;
+    spin_unlock(&board->ddr_map_lock);
+}
+
+static const struct vm_operations_struct char_ddr_vm_ops = {
+    .open = char_ddr_vm_open,
+    .close = char_ddr_vm_close,
+};
+
+/* Map (part of) BAR2, showing the page selected by DDR_LOCK_PAGE.
+ * The mmap() offset is within BAR2.
+ * Called with mmap_sem held, so must not take ddr_lock.
+ */
+static
+int char_ddr_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct board_data *board = (struct board_data *)filp->private_data;
+    struct pci_dev *dev = board->pci_dev;
+    int ret = 0;
+
+    /* count the mapping now, so DDR_UNLOCK_PAGE fails while we set it up.
+     * vm_ops->open() isn't called for the first mapping.
+     */
+    spin_lock(&board->ddr_map_lock);
+    if(board->ddr_owner==filp)
+        board->ddr_maps++;
+    else
+        ret = -EPERM; /* must DDR_LOCK_PAGE first */
+    spin_unlock(&board->ddr_map_lock);
+
+    if(ret)
+        return ret;
+
+#ifdef CONFIG_AMC_PICO_SIM
+    if(board->sim) {
+        ret = -ENODEV; /* no BAR2 to map */
+    } else
+#endif
+    {
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+#if LINUX_VERSION_CODE>=KERNEL_VERSION(3,10,0)
+        /* checks offset and length against BAR2 */
+        ret = vm_iomap_memory(vma, pci_resource_start(dev, 2), pci_resource_len(dev, 2));
+#else
+        {
+            unsigned long off = vma->vm_pgoff<<PAGE_SHIFT,
+                          len = vma->vm_end-vma->vm_start;
+            if(off>=pci_resource_len(dev, 2) || len>pci_resource_len(dev, 2)-off)
+                ret = -EINVAL;
+            else
+                ret = io_remap_pfn_range(vma, vma->vm_start,
+                                         (pci_resource_start(dev, 2)+off)>>PAGE_SHIFT,
+                                         len, vma->vm_page_prot);
+        }
+#endif
+    }
+
+    if(!ret) {
+        vma->vm_ops = &char_ddr_vm_ops;
+    } else {
+        /* no vm_ops->close() will follow */
+        spin_lock(&board->ddr_map_lock);
+        board->ddr_maps--;
+        spin_unlock(&board->ddr_map_lock);
+    }
+
+    dev_dbg(&dev->dev, "DDR mmap() -> %d\n", ret);
+    return ret;
+}
+
 static
 loff_t char_ddr_llseek(struct file *filp, loff_t pos, int whence)
 {
@@ -85,13 +259,52 @@ loff_t char_ddr_llseek(struct file *filp, loff_t pos, int whence)
     return npos;
 }
 
+/* Where read()/write() data goes to/comes from */
+struct ddr_xfer {
+#ifdef PICO_DDR_ITER
+    struct iov_iter *iter;
+#else
+    char __user *buf;
+#endif
+};
+
+static
+int ddr_xfer_out(struct ddr_xfer *x, const void *src, size_t n)
+{
+#ifdef PICO_DDR_ITER
+    return copy_to_iter(src, n, x->iter)==n ? 0 : -EFAULT;
+#else
+    if(copy_to_user(x->buf, src, n))
+        return -EFAULT;
+    x->buf += n;
+    return 0;
+#endif
+}
+
+static
+int ddr_xfer_in(struct ddr_xfer *x, void *dst, size_t n)
+{
+#ifdef PICO_DDR_ITER
+    return copy_from_iter(dst, n, x->iter)==n ? 0 : -EFAULT;
+#else
+    if(copy_from_user(dst, x->buf, n))
+        return -EFAULT;
+    x->buf += n;
+    return 0;
+#endif
+}
+
+/* Move [*pos, *pos+count) in one pass under ddr_lock.
+ * With PICO_DDR_ITER, this is all segments of a readv()/writev().
+ */
 static
-ssize_t char_ddr_readwrite(struct board_data *board,
-                           char __user *buf,
+ssize_t char_ddr_readwrite(struct file *filp,
+                           struct ddr_xfer *x,
                            size_t count,
                            loff_t *pos,
                            int iswrite)
 {
+    struct board_data *board = (struct board_data *)filp->private_data;
     ssize_t ret=0;
     size_t page_size = resource_size(&board->pci_dev->resource[2]),
            limit = page_size*DDR_SELECT_COUNT;
@@ -122,6 +335,15 @@ ssize_t char_ddr_readwrite(struct board_data *board,
     if(mutex_lock_interruptible(&board->ddr_lock))
         return -EINTR;
 
+    if(board->ddr_owner && board->ddr_owner!=filp) {
+        mutex_unlock(&board->ddr_lock);
+        return -EBUSY; /* another FD holds DDR_LOCK_PAGE */
+    }
+
+    if(!board->ddr_buffer)
+        board->ddr_buffer = kmalloc_node(DDR_BOUNCE_SIZE, GFP_KERNEL, board->numa_node);
+    /* fall back to word at a time if allocation fails */
+
     while(npos<limit && !ret) {
         /* page and offset in device */
         unsigned page = npos/page_size, i,
@@ -134,26 +356,48 @@ ssize_t char_ddr_readwrite(struct board_data *board,
             ret = -ERESTARTSYS;
             break;
         }
-        /* relinquish CPU once per page */
-        schedule();
+        /* relinquish CPU between pages if needed */
+        cond_resched();
 
         dev_dbg(&board->pci_dev->dev,"%s Page %u [%u, %u)\n",
                 iswrite ? "WRITE" : "READ",
                 page, (unsigned)devoffset, (unsigned)devlimit);
 
-        iowrite32(page, board->bar0+DDR_SELECT);
+        ddr_select(board, page);
 
-        for(i=devoffset; i<devlimit && !ret; i+=4, buf+=4) {
-            uint32_t val;
+        if(board->ddr_buffer && ACCESS_ONCE(dmac_ddr_burst)) {
+            for(i=devoffset; i<devlimit && !ret; ) {
+                size_t n = min_t(size_t, devlimit-i, DDR_BOUNCE_SIZE);
 
-            if(!iswrite) {
-                val = ioread32(board->bar2+i);
-                ret = put_user(val, (uint32_t*)buf);
+                if(!iswrite) {
+                    memcpy_fromio(board->ddr_buffer, board->bar2+i, n);
+                    ret = ddr_xfer_out(x, board->ddr_buffer, n);
 
-            } else {
-                ret = get_user(val, (uint32_t*)buf);
+                } else {
+                    ret = ddr_xfer_in(x, board->ddr_buffer, n);
+                    if(!ret)
+                        memcpy_toio(board->bar2+i, board->ddr_buffer, n);
+                }
                 if(!ret)
-                    iowrite32(val, board->bar2+i);
+                    i += n;
+            }
+            /* order the last writes before changing DDR_SELECT */
+            if(iswrite)
+                wmb();
+
+        } else {
+            for(i=devoffset; i<devlimit && !ret; i+=4) {
+                uint32_t val;
+
+                if(!iswrite) {
+                    val = ioread32(board->bar2+i);
+                    ret = ddr_xfer_out(x, &val, 4);
+
+                } else {
+                    ret = ddr_xfer_in(x, &val, 4);
+                    if(!ret)
+                        iowrite32(val, board->bar2+i);
+                }
             }
         }
 
@@ -161,6 +405,10 @@ ssize_t char_ddr_readwrite(struct board_data *board,
         count += i-devoffset;
     }
 
+    /* restore page for our mmap() */
+    if(board->ddr_owner)
+        ddr_select(board, board->ddr_page);
+
     mutex_unlock(&board->ddr_lock);
 
     if(ret) {
@@ -175,15 +423,35 @@ ssize_t char_ddr_readwrite(struct board_data *board,
     }
 }
 
+#ifdef PICO_DDR_ITER
+
+static
+ssize_t char_ddr_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct ddr_xfer x = {to};
+
+    return char_ddr_readwrite(iocb->ki_filp, &x, iov_iter_count(to), &iocb->ki_pos, 0);
+}
+
+static
+ssize_t char_ddr_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct ddr_xfer x = {from};
+
+    return char_ddr_readwrite(iocb->ki_filp, &x, iov_iter_count(from), &iocb->ki_pos, 1);
+}
+
+#else /* PICO_DDR_ITER */
+
 static
 ssize_t char_ddr_write(struct file *filp,
                        const char __user *buf,
                        size_t count,
                        loff_t *pos)
 {
-    struct board_data *board = (struct board_data *)filp->private_data;
+    struct ddr_xfer x = {(char __user *)buf};
 
-    return char_ddr_readwrite(board, (char * __user)buf, count, pos, 1);
+    return char_ddr_readwrite(filp, &x, count, pos, 1);
 }
 
 static
@@ -194,17 +462,25 @@ ssize_t char_ddr_read(
         loff_t *pos
         )
 {
-    struct board_data *board = (struct board_data *)filp->private_data;
+    struct ddr_xfer x = {buf};
 
-    return char_ddr_readwrite(board, buf, count, pos, 0);
+    return char_ddr_readwrite(filp, &x, count, pos, 0);
 }
 
+#endif /* PICO_DDR_ITER */
+
 const struct file_operations amc_ddr_fops = {
     .owner		= THIS_MODULE,
     .open		= char_ddr_open,
     .release	= char_ddr_release,
     .unlocked_ioctl = char_ddr_ioctl,
+#ifdef PICO_DDR_ITER
+    .read_iter  = char_ddr_read_iter,
+    .write_iter = char_ddr_write_iter,
+#else
     .read		= char_ddr_read,
     .write      = char_ddr_write,
+#endif
     .llseek     = char_ddr_llseek,
+    .mmap       = char_ddr_mmap,
 };
@@ -21,23 +21,39 @@
  */
 
  #include "amc_pico_dma.h"
+ #include "amc_pico_trace.h"
 
-void dma_push(struct board_data *dev, uint32_t address, uint32_t length, int gen_irq)
+void dma_push(struct board_data *dev, dma_addr_t address, uint32_t length, int gen_irq)
 {
-	iowrite32(address, dev->bar0 + DMA_ADDR + DMA_OFFSET_ADDR);
+	trace_pico_dma_push(dev, address, length, gen_irq);
+
+	/* device masked to 32-bit DMA in pico_pci_setup() */
+	WARN_ON_ONCE(upper_32_bits(address));
+
+	pico_wr32(dev, lower_32_bits(address), DMA_ADDR + DMA_OFFSET_ADDR);
     dev_dbg(&dev->pci_dev->dev,  "   dma_start(): DMA address readback: %08x\n",
-		ioread32(dev->bar0 + DMA_ADDR + DMA_OFFSET_ADDR));
+		pico_rd32(dev, DMA_ADDR + DMA_OFFSET_ADDR));
 
-	iowrite32(length, dev->bar0 + DMA_ADDR + DMA_OFFSET_LEN);
+	pico_wr32(dev, length, DMA_ADDR + DMA_OFFSET_LEN);
     dev_dbg(&dev->pci_dev->dev,  "   dma_start(): DMA length readback: %08x\n",
-		ioread32(dev->bar0 + DMA_ADDR + DMA_OFFSET_LEN));
+		pico_rd32(dev, DMA_ADDR + DMA_OFFSET_LEN));
 
 	/* make sure that address and length have been written */
 	mb();
     dev_dbg(&dev->pci_dev->dev,  "   dma_start(): DMA command go%s!\n",
 		gen_irq ? ", gen irq" : "");
-	iowrite32(DMA_CMD_MASK_DMA_GO  | (gen_irq ? DMA_CMD_MASK_GEN_IRQ : 0 ),
-		dev->bar0 + DMA_ADDR + DMA_OFFSET_CMD);
+	pico_wr32(dev, DMA_CMD_MASK_DMA_GO  | (gen_irq ? DMA_CMD_MASK_GEN_IRQ : 0 ),
+		DMA_ADDR + DMA_OFFSET_CMD);
+
+	dev->dma_push_len[dev->dma_pushed%DMA_CMD_RING] = length;
+	dev->dma_pushed++;
+}
+
+void dma_push_buf(struct board_data *dev, uint32_t length, int gen_irq)
+{
+	unsigned idx = dev->dma_pushed%DMA_BUF_COUNT;
+
+	dma_push(dev, dev->dma_buf[idx], length, gen_irq);
 }
 
 
@@ -45,13 +61,14 @@ void dma_enable(struct board_data *dev, int enable)
 {
 	uint32_t ctrl = enable ? DMA_CTRL_MASK_ENABLE : 0;
 
+	trace_pico_dma_enable(dev, enable);
 
-	iowrite32(ctrl, dev->bar0 + DMA_ADDR + DMA_OFFSET_CONTROL);
+	pico_wr32(dev, ctrl, DMA_ADDR + DMA_OFFSET_CONTROL);
 
 /** Register access during DMA sometimes trigger hard lockup of device.
  *  The following is a great way to trigger this.
  *  Resolved w/ DMA controller FW fix in Jan 2016
-	ctrl = ioread32(dev->bar0 + DMA_ADDR + DMA_OFFSET_CONTROL);
+	ctrl = pico_rd32(dev, DMA_ADDR + DMA_OFFSET_CONTROL);
     dev_dbg(&dev->pci_dev->dev, "   dma_enable(): ctrl read: 0x%08x\n", ctrl);
  */
 }
@@ -59,9 +76,12 @@ void dma_enable(struct board_data *dev, int enable)
 
 void dma_reset(struct board_data *dev)
 {
-	iowrite32(DMA_CTRL_MASK_RESET,
-		dev->bar0 + DMA_ADDR + DMA_OFFSET_CONTROL);
+	trace_pico_dma_reset(dev);
+
+	pico_wr32(dev, DMA_CTRL_MASK_RESET, DMA_ADDR + DMA_OFFSET_CONTROL);
 
 	/* force write before continuing */
 	mb();
+
+	dev->dma_pushed = dev->dma_completed = 0;
 }
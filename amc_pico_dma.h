@@ -64,9 +64,23 @@
  *
  * Pushes a new command (address, length and flag to generate irq when done)
  * to DMA FIFO.
+ * The DMA engine takes 32-bit addresses, which the DMA mask ensures.
  */
 
-void dma_push(struct board_data *board, uint32_t address, uint32_t length, int gen_irq);
+void dma_push(struct board_data *board, dma_addr_t address, uint32_t length, int gen_irq);
+
+/**
+ * \brief Pushes the next DMA buffer in sequence
+ * \param board    amc_pico board_data
+ * \param length   length in bytes (<= DMA_BUF_SIZE)
+ * \param gen_irq  selects if the transfer generates interrupt
+ *
+ * Command N targets kernel_mem_buf[N%DMA_BUF_COUNT], where N counts
+ * commands pushed since the last dma_reset().
+ * Call with dma_queue.lock held.
+ */
+
+void dma_push_buf(struct board_data *board, uint32_t length, int gen_irq);
 
 /**
  * \brief Enables or pauses DMA engine
@@ -81,6 +95,8 @@ void dma_enable(struct board_data *board, int enable);
  * \brief Resets the DMA engine
  * \param board    amc_pico board_data
  *
+ * Also flushes the command and response FIFOs,
+ * so the command sequence restarts at zero.
  */
 void dma_reset(struct board_data *board);
 
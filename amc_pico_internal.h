@@ -31,6 +31,9 @@
 #include <linux/device.h>
 #include <linux/pci.h>
 #include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/io.h>
 
 #include "amc_pico.h"
 #include "amc_pico_regs.h"
@@ -42,11 +45,59 @@
 /** Number of buffers allocated for DMA */
 #define DMA_BUF_COUNT		(8)
 
+/** Number of in-flight DMA commands whose lengths are tracked.
+ *  Must be a multiple of DMA_BUF_COUNT
+ */
+#define DMA_CMD_RING		(64)
+
+/** Most DMA commands queued to the card at once.
+ *  The depth of the command FIFO is not documented, and STATUS gives only
+ *  the response count.  DMA_BUF_COUNT is what has always been queued
+ *  by one-shot reads, so is known to fit.  Must be <= DMA_CMD_RING
+ */
+#define DMA_CMD_FIFO_DEPTH	(DMA_BUF_COUNT)
+
+/** Bounce buffer size for DDR char. dev. transfers */
+#define DDR_BOUNCE_SIZE		(64*1024)
+
 /** Buffer size allocated (should be <= 4MB) */
 #define DMA_BUF_SIZE		damc_dma_buf_len
 extern unsigned long damc_dma_buf_len;
+/* limit for MAP_USER_BUF */
+extern unsigned long damc_max_user_buf;
 
 irqreturn_t amc_isr(int irq, void *dev_id);
+irqreturn_t amc_isr_thread(int irq, void *dev_id);
+
+struct file_data;
+struct board_data;
+
+#ifdef CONFIG_AMC_PICO_SIM
+/* software stand-in for the card, see amc_pico_sim.h */
+struct pico_sim;
+uint32_t pico_sim_read(struct board_data *board, unsigned offset);
+void pico_sim_write(struct board_data *board, uint32_t val, unsigned offset);
+#endif
+
+/** Number of log2 nanosecond histogram buckets.
+ *  Bucket i counts [2**i, 2**(i+1)) ns, and the last is open ended.
+ */
+#define PICO_HIST_BUCKETS	(32)
+
+struct pico_hist {
+    atomic_t count[PICO_HIST_BUCKETS];
+};
+
+/** Shadow of the PICO_ADDR configuration registers */
+struct pico_regs {
+    uint32_t control;    /* PICO_ADDR+0, range in low 8 bits */
+    uint32_t conv_trg;   /* PICO_CONV_TRG, gate and conv mux */
+    uint32_t conv_gen;   /* PICO_CONV_GEN, sample clock divider */
+    uint32_t ring_delay; /* RING_BUFF_OFFS_DELAY */
+    uint32_t trg_ctrl;   /* TRG_OFFS_CTRL */
+    uint32_t trg_limit;  /* TRG_OFFS_LIMIT */
+    uint32_t trg_nrsamp; /* TRG_OFFS_NRSAMP */
+};
 
 enum dmac_irqmode_t {
     dmac_irq_poll,
@@ -74,6 +125,25 @@ struct board_data {
     char * __iomem bar2;
 
     enum dmac_irqmode_t irqmode;
+    /* set by remove() when INTR_ENABLE is cleared, after which
+     * amc_isr() and amc_isr_thread() must not unmask.
+     * Protected by dma_queue.lock
+     */
+    unsigned closing;
+
+#ifdef CONFIG_AMC_PICO_SIM
+    /* simulated card behind bar0 and bar2, or NULL */
+    struct pico_sim *sim;
+#endif
+
+    /* FPGA_VER_OFFSET read during probe() */
+    uint32_t fw_version;
+
+    /* NUMA node of the card, where buffers are allocated (or NUMA_NO_NODE),
+     * and CPU hinted to service the IRQ (or -1)
+     */
+    int numa_node;
+    int irq_cpu;
 
 	/* number of interrupts */
     uint32_t irq_count;
@@ -97,23 +167,270 @@ struct board_data {
     unsigned dma_irq_flag;
     uint32_t dma_bytes_trans;
 
+    /* DMA command/response sequence, reset by dma_reset().
+     * Buffer command N always targets kernel_mem_buf[N%DMA_BUF_COUNT]
+     * and amc_isr() pops responses in the same order.
+     * Lengths of command N are kept in [N%DMA_CMD_RING].
+     * Protected by dma_queue.lock
+     */
+    unsigned dma_pushed;
+    unsigned dma_completed;
+    uint32_t dma_push_len[DMA_CMD_RING];
+    uint32_t dma_resp_len[DMA_CMD_RING];
+
+    /* FD which armed the current acquisition (NULL when idle),
+     * and whether a read() is waiting on it.
+     * Protected by dma_queue.lock
+     */
+    struct file_data *acq_owner;
+    unsigned acq_busy;
+    size_t acq_count;
+
+    /* acquisition cycling DMA buffers (READ_MODE_STREAM, and large reads).
+     * ring_seq is the command whose buffer read() is draining.
+     * ring_unpushed is bytes not yet pushed, unless ring_stream.
+     * Protected by dma_queue.lock
+     */
+    unsigned ring_stream;
+    size_t ring_unpushed;
+    unsigned ring_seq;
+    uint32_t ring_offset;
+    uint32_t ring_overruns;
+
+    /* number of acquisitions armed, and ktime_get() ns of the last.
+     * acq_config is a copy of the settings in regs, kept by
+     * pico_config_publish(), and arm_config what it was when armed.
+     * Protected by dma_queue.lock
+     */
+    u64 acq_seq;
+    u64 acq_arm_ns;
+    struct pico_acq_config acq_config;
+    struct pico_acq_config arm_config;
+
+    /* READ_MODE_SHARED.  One acquisition at a time is armed (shared_armed).
+     * When complete it becomes number shared_seq, of shared_len bytes, which
+     * each subscribed FD may copy from the DMA buffers until the next is armed.
+     * shared_valid is cleared when other read modes or BIST() reuse the buffers.
+     * shared_hdr describes it for SET_READ_HEADER.
+     * read_in_progress is set while armed, or while shared_copying.
+     * ABORT_READ increments shared_aborts.
+     * Protected by dma_queue.lock
+     */
+    unsigned shared_readers;
+    unsigned shared_armed;
+    unsigned shared_copying;
+    uint32_t shared_seq;
+    size_t shared_len;
+    unsigned shared_valid;
+    struct pico_read_header shared_hdr;
+    uint32_t shared_aborts;
+
     uint32_t site;
 
+    /* configuration ioctl()s write through this, and getters read it.
+     * Re-read by pico_regs_resync() when registers may have been changed
+     * behind our back (FRIB register access).
+     * Protected by reg_lock, which may sleep and is not taken by amc_isr()
+     */
+    struct mutex reg_lock;
+    struct pico_regs regs;
+
 #ifdef CONFIG_AMC_PICO_FRIB
-    unsigned capture_ready;
+    /* set by ABORT_READ, cleared by the next capture read() */
+    unsigned capture_abort;
+    /* bytes of capture registers in each event */
     unsigned capture_length;
-    uint32_t *capture_buf;
+    /* ring of capture_nslots (a power of 2) events, see frib_capture_slot().
+     * amc_isr_thread() fills slot capture_head, and readers drain
+     * from capture_tail.  Full ring drops new events.
+     * Protected by capture_queue.lock
+     */
+    void *capture_buf;
+    unsigned capture_nslots;
+    unsigned capture_head, capture_tail;
+    uint32_t capture_seq;
+    uint32_t capture_lost;
     wait_queue_head_t capture_queue;
+    /* one reader at a time owns slots [capture_tail, capture_head) */
+    struct mutex capture_read_lock;
 #endif
 
     atomic_t num_isr;
     cycles_t last_isr;
     cycles_t longest_isr;
 
+    /* page mmap()'d read-only by user space.  Updated by amc_isr(),
+     * serialized under dma_queue.lock as it may also run from pico_poll_isr()
+     */
+    struct pico_status *status;
+
+    /* cumulative counters for GET_STATS, see struct pico_stats */
+    atomic64_t stat_bytes;
+    atomic64_t stat_reads;
+    atomic64_t stat_aborts;
+    atomic64_t stat_cancelled;
+    atomic64_t stat_fifo_runaway;
+    atomic64_t stat_empty_done;
+    atomic64_t stat_short_xfer;
+
+    /* latency histograms, see pico_hist_add() */
+    struct pico_hist hist_isr;    /* amc_isr() duration */
+    struct pico_hist hist_wakeup; /* DMA_DONE to reader running */
+    struct pico_hist hist_arm;    /* arming to first DMA completion */
+    struct pico_hist hist_copy;   /* copy_to_user() of DMA data */
+    /* ktime_get() ns of last DMA_DONE, and of arming (0 after first completion).
+     * Protected by dma_queue.lock
+     */
+    u64 irq_ns;
+    u64 arm_ns;
+
     /* prevent concurrent access to onboard DDR ram.
      * protecting page selection register and ddr_buffer
      */
     struct mutex ddr_lock;
+    /* DDR_BOUNCE_SIZE bytes, allocated on first use */
+    void *ddr_buffer;
+    /* FD holding DDR_LOCK_PAGE (or NULL), its page, and number of mmap()s.
+     * ddr_page is protected by ddr_lock.  ddr_maps by ddr_map_lock.
+     * ddr_owner is changed with both held, so may be read with either.
+     * The mmap() paths run under mmap_sem, which copy_to_user() under
+     * ddr_lock may take, so they take only ddr_map_lock.
+     */
+    spinlock_t ddr_map_lock;
+    struct file *ddr_owner;
+    uint32_t ddr_page;
+    unsigned ddr_maps;
+    /* last value written to DDR_SELECT, or -1 when unknown.  Protected by ddr_lock */
+    uint32_t ddr_cur_page;
+
+    /* last BIST() report (PAGE_SIZE, NULL until run), protected by bist_lock */
+    char *bist_report;
+    struct mutex bist_lock;
 };
 
+/** Read a DMA_ADDR or INTR_ADDR register.
+ *  These have side effects, which a simulated board must model.
+ */
+static inline
+uint32_t pico_rd32(struct board_data *board, unsigned offset)
+{
+#ifdef CONFIG_AMC_PICO_SIM
+    if(unlikely(board->sim))
+        return pico_sim_read(board, offset);
+#endif
+    return ioread32(board->bar0 + offset);
+}
+
+/** Write a DMA_ADDR or INTR_ADDR register */
+static inline
+void pico_wr32(struct board_data *board, uint32_t val, unsigned offset)
+{
+#ifdef CONFIG_AMC_PICO_SIM
+    if(unlikely(board->sim)) {
+        pico_sim_write(board, val, offset);
+        return;
+    }
+#endif
+    iowrite32(val, board->bar0 + offset);
+}
+
+/** Count one interval of ns nanoseconds */
+static inline
+void pico_hist_add(struct pico_hist *hist, s64 ns)
+{
+    unsigned i = ns>1 ? fls64(ns)-1 : 0;
+    if(i>=PICO_HIST_BUCKETS)
+        i = PICO_HIST_BUCKETS-1;
+    atomic_inc(&hist->count[i]);
+}
+
+/** Count the interval since 'start' (ktime_get() in ns) */
+static inline
+void pico_hist_since(struct pico_hist *hist, u64 start)
+{
+    pico_hist_add(hist, ktime_to_ns(ktime_get())-start);
+}
+
+/** Settings from board->regs, as for SET_ACQ_CONFIG with mask==0.
+ * Call with reg_lock held.
+ */
+static inline
+void pico_get_config(struct board_data *board, struct pico_acq_config *cfg)
+{
+    const struct pico_regs *regs = &board->regs;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->version = PICO_ACQ_CONFIG_VERSION;
+    cfg->range = regs->control & 0xFF;
+    cfg->fsamp = PICO_CLK_FREQ / (regs->conv_gen + 1);
+    *(uint32_t*)&cfg->trg_limit = regs->trg_limit;
+    cfg->trg_nr_samp = regs->trg_nrsamp;
+    cfg->trg_ch_sel = (regs->trg_ctrl >> TRG_CTRL_CH_SHIFT) & 0x7;
+    cfg->trg_mode = regs->trg_ctrl & 0x3;
+    cfg->ring_buf = regs->ring_delay;
+    cfg->gate_mux = (regs->conv_trg >> MUX_TRG_SHIFT) & MUX_TRG_MASK;
+    cfg->conv_mux = (regs->conv_trg >> MUX_CONV_SHIFT) & MUX_CONV_MASK;
+}
+
+/** Update board->acq_config after board->regs changes, so arming
+ * (under dma_queue.lock) can take a copy.  Call with reg_lock held.
+ */
+static inline
+void pico_config_publish(struct board_data *board)
+{
+    struct pico_acq_config cfg;
+
+    pico_get_config(board, &cfg);
+
+    spin_lock_irq(&board->dma_queue.lock);
+    board->acq_config = cfg;
+    spin_unlock_irq(&board->dma_queue.lock);
+}
+
+/** Re-read board->regs from hardware.  Call with reg_lock held */
+static inline
+void pico_regs_resync(struct board_data *board)
+{
+    struct pico_regs *regs = &board->regs;
+    char __iomem *base = board->bar0 + PICO_ADDR;
+
+    regs->control = ioread32(base);
+    regs->conv_trg = ioread32(base + PICO_CONV_TRG);
+    regs->conv_gen = ioread32(base + PICO_CONV_GEN);
+    regs->ring_delay = ioread32(base + RING_BUFF_OFFS_DELAY);
+    regs->trg_ctrl = ioread32(base + TRG_OFFS_CTRL);
+    regs->trg_limit = ioread32(base + TRG_OFFS_LIMIT);
+    regs->trg_nrsamp = ioread32(base + TRG_OFFS_NRSAMP);
+
+    pico_config_publish(board);
+}
+
+/** DDR_SELECT may have been written other than by ddr_select().
+ * Takes ddr_lock, so call without reg_lock held.
+ */
+static inline
+void pico_ddr_resync(struct board_data *board)
+{
+    mutex_lock(&board->ddr_lock);
+    board->ddr_cur_page = (uint32_t)-1;
+    mutex_unlock(&board->ddr_lock);
+}
+
+#ifdef CONFIG_AMC_PICO_FRIB
+/** Size of one capture ring slot, header and registers */
+static inline
+size_t frib_capture_slot_size(const struct board_data *board)
+{
+    return sizeof(struct pico_frib_event) + board->capture_length;
+}
+
+/** Capture ring slot of event n */
+static inline
+struct pico_frib_event *frib_capture_slot(struct board_data *board, unsigned n)
+{
+    return (struct pico_frib_event*)((char*)board->capture_buf
+            + (n&(board->capture_nslots-1))*frib_capture_slot_size(board));
+}
+#endif
+
 #endif /* AMC_PICO_INTERNAL_H_ */
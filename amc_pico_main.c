@@ -35,6 +35,7 @@
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/jiffies.h>
+#include <linux/log2.h>
 #include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/pci.h>
@@ -43,6 +44,7 @@
 #include <linux/interrupt.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/vmalloc.h>
 #include <asm/io.h>
 #include <asm/ioctl.h>
 
@@ -51,8 +53,12 @@
 #include "amc_pico_dma.h"
 #include "amc_pico_char.h"
 #include "amc_pico_bist.h"
+#include "amc_pico_sim.h"
 #include "amc_pico_version.h"
 
+#define CREATE_TRACE_POINTS
+#include "amc_pico_trace.h"
+
 #define DRV_NAME "AMC-Pico8 Driver"
 
 
@@ -120,6 +126,12 @@ module_param_named(dma_buf_len, damc_req_dma_buf_len, ulong, 0444);
 
 unsigned long damc_dma_buf_len;
 
+/* Largest buffer accepted by MAP_USER_BUF.
+ * Also limited by RLIMIT_MEMLOCK.
+ */
+ulong damc_max_user_buf = 256*1024*1024;
+module_param_named(max_user_buf, damc_max_user_buf, ulong, 0644);
+
 /* 0 - polled  (debugging)
  * 1 - classic PCI level IRQ
  * 2 - PCI MSI
@@ -127,6 +139,30 @@ unsigned long damc_dma_buf_len;
 uint dmac_irqmode = 2;
 module_param_named(irqmode, dmac_irqmode, uint, 0444);
 
+#ifdef CONFIG_AMC_PICO_SIM
+/* Number of simulated boards to create, see amc_pico_sim.h */
+static
+uint dmac_sim_boards;
+module_param_named(sim_boards, dmac_sim_boards, uint, 0444);
+
+static
+struct pci_dev *sim_devs[PICO_SIM_MAX_BOARDS];
+
+#ifdef CONFIG_AMC_PICO_FRIB
+/* Simulated boards appear to have FRIB firmware, for FRIB_REG_BATCH etc. */
+static
+uint dmac_sim_frib;
+module_param_named(sim_frib, dmac_sim_frib, uint, 0444);
+#endif
+#endif
+
+#ifdef CONFIG_AMC_PICO_FRIB
+/* Number of FRIB capture events buffered for read() */
+static
+uint dmac_capture_slots = 64;
+module_param_named(capture_slots, dmac_capture_slots, uint, 0444);
+#endif
+
 /** List of devices this driver recognizes */
 static const struct pci_device_id ids[] = {
 	{ .vendor = PCI_VENDOR_ID_XILINX, .device = 0x0007,
@@ -157,13 +193,46 @@ void calib_cycles(uint64_t *cycles, uint64_t *nano)
     *nano = timespec_to_ns(&tA);
 }
 
+/* Publish to the status page.
+ * amc_isr() may run concurrently in polled mode (read() and BIST()),
+ * so call with dma_queue.lock held to have a single writer.
+ */
+static
+void pico_status_update(struct board_data *board, int done, u64 done_ns)
+{
+    struct pico_status *st = board->status;
+
+    ACCESS_ONCE(st->seq) = st->seq+1;
+    smp_wmb();
+    if(done) {
+        st->dma_done++;
+        st->done_ns = done_ns;
+        st->bytes_trans = board->dma_bytes_trans;
+        st->acq_seq = board->acq_seq;
+    }
+    st->num_isr = atomic_read(&board->num_isr);
+    st->last_isr = board->last_isr;
+    st->longest_isr = board->longest_isr;
+    st->aborts = atomic64_read(&board->stat_aborts);
+    st->fifo_runaway = atomic64_read(&board->stat_fifo_runaway);
+    st->empty_done = atomic64_read(&board->stat_empty_done);
+    st->short_xfer = atomic64_read(&board->stat_short_xfer);
+    smp_wmb();
+    ACCESS_ONCE(st->seq) = st->seq+1;
+}
+
 irqreturn_t amc_isr(int irq, void *dev_id)
 {
     cycles_t tstart;
+    u64 kstart;
     struct board_data *board;
-    uint32_t active;
+    uint32_t active, fifo = 0;
+    size_t nbytes = 0;
+    int done = 0;
+    irqreturn_t ret = IRQ_HANDLED;
 
     tstart = get_cycles();
+    kstart = ktime_to_ns(ktime_get());
 
     board = (struct board_data *)dev_id;
 
@@ -171,7 +240,7 @@ irqreturn_t amc_isr(int irq, void *dev_id)
     if (board == NULL)
         return IRQ_NONE;
 
-    active = ioread32(board->bar0+INTR_LATCH);
+    active = pico_rd32(board, INTR_LATCH);
     if(unlikely(active&~INTR_MASK)) {
         /* Maybe some new FW feature has signaled an interrupt we don't know
          * how to handle, and can't mask out.
@@ -189,23 +258,33 @@ irqreturn_t amc_isr(int irq, void *dev_id)
         return IRQ_NONE;
     }
 
+    trace_pico_isr_enter(board, active);
+
     if(active&INTR_DMA_DONE) {
         size_t nsent = 0;
         unsigned long flags;
         unsigned cycles = 0;
         int op = 1;
+        uint32_t count;
+
+        /* dma_queue.lock also guards the response FIFO against dma_reset() */
+        spin_lock_irqsave(&board->dma_queue.lock, flags);
 
-        uint32_t count = (ioread32(board->bar0 + DMA_ADDR + DMA_OFFSET_STATUS) >> 16) & 0x7FF;
+        count = (pico_rd32(board, DMA_ADDR + DMA_OFFSET_STATUS) >> 16) & 0x7FF;
+        fifo = count;
 
         dev_dbg(&board->pci_dev->dev, "ISR: irq: 0x%x %u\n", irq, (unsigned)count);
 
         if(unlikely(count==0)) {
             WARN_ONCE(1, "PICO8 DMA DONE w/ response fifo empty\n");
+            atomic64_inc(&board->stat_empty_done);
             dev_dbg(&board->pci_dev->dev, "DMA DONE w/ response fifo empty\n");
 
         } else {
 
             while (count > 0) {
+                uint32_t len;
+
                 if (unlikely(count == 0xFFFFFFFFUL)) {
                     WARN_ONCE(1, "PICO8 something wrong when reading from DMA\n");
                     dev_dbg(&board->pci_dev->dev,
@@ -216,72 +295,72 @@ irqreturn_t amc_isr(int irq, void *dev_id)
                     WARN_ONCE(1, "PICO8 FIFO ran away, stopping\n");
                     dev_dbg(&board->pci_dev->dev, "FIFO ran away, stopping\n");
                     op = 2;
+                    atomic64_inc(&board->stat_fifo_runaway);
                     break;
                 }
 
-                nsent += ioread32(board->bar0 + DMA_ADDR + DMA_OFFSET_RESP_LEN);
+                len = pico_rd32(board, DMA_ADDR + DMA_OFFSET_RESP_LEN);
+
+                /* remember per command length for ring buffer and direct readers */
+                if(likely(board->dma_completed!=board->dma_pushed)) {
+                    unsigned idx = board->dma_completed%DMA_CMD_RING;
+                    /* readers copy this much from the buffer, so never more than was pushed */
+                    if(unlikely(len>board->dma_push_len[idx]))
+                        len = board->dma_push_len[idx];
+                    board->dma_resp_len[idx] = len;
+                    if(len<board->dma_push_len[idx])
+                        atomic64_inc(&board->stat_short_xfer);
+                    board->dma_completed++;
+                }
+                nsent += len;
+
                 dev_dbg(&board->pci_dev->dev, "   ISR: resp count: %08x\n", count);
                 dev_dbg(&board->pci_dev->dev, "   ISR: resp len: %08x\n", (unsigned)nsent);
                 dev_dbg(&board->pci_dev->dev, "   ISR: resp addr: %08x\n",
-                        ioread32(board->bar0 + DMA_ADDR + DMA_OFFSET_RESP_ADDR));
+                        pico_rd32(board, DMA_ADDR + DMA_OFFSET_RESP_ADDR));
 
                 /* pop from resp fifo */
-                iowrite32(0, board->bar0 + DMA_ADDR + DMA_OFFSET_RESP_LEN);
+                pico_wr32(board, 0, DMA_ADDR + DMA_OFFSET_RESP_LEN);
                 mb();
-                count = (ioread32(board->bar0 + DMA_ADDR + DMA_OFFSET_STATUS) >> 16) & 0x7FF;
+                count = (pico_rd32(board, DMA_ADDR + DMA_OFFSET_STATUS) >> 16) & 0x7FF;
             }
 
-            spin_lock_irqsave(&board->dma_queue.lock, flags);
-            board->dma_irq_flag = op;
+            /* never lose a pending ABORT_READ */
+            if(board->dma_irq_flag!=2)
+                board->dma_irq_flag = op;
             board->dma_bytes_trans = nsent;
+            if(board->arm_ns) {
+                pico_hist_add(&board->hist_arm, kstart-board->arm_ns);
+                board->arm_ns = 0;
+            }
+            board->irq_ns = kstart;
+            done = 1;
             wake_up_locked(&board->dma_queue);
-            spin_unlock_irqrestore(&board->dma_queue.lock, flags);
 
             dev_dbg(&board->pci_dev->dev, "ISR: waked up dma_queue\n");
         }
+
+        spin_unlock_irqrestore(&board->dma_queue.lock, flags);
+        nbytes = nsent;
+        atomic64_add(nsent, &board->stat_bytes);
     }
     if(active&INTR_USER) {
         if(0) {}
 #ifdef CONFIG_AMC_PICO_FRIB
         else if(board->site==USER_SITE_FRIB) {
-            uint32_t status = ioread32(board->bar0+USER_STATUS);
             unsigned long flags;
-            /* TODO: Note, being sloppy with locking here
-             *  Not sure how to guard this buffer since can't copy_to_user()
-             *  with spinlock held.
-             *  maybe double buffer?
-             */
-            uint32_t *buf = board->capture_buf;
-            uint32_t i;
 
-            if(status&(1<<17)) { /* waiting for ACK */
-                for(i=0; i<board->capture_length; i+=4) {
-                    *buf++ = ioread32(board->bar0 + FRIB_CAP_FIRST + i);
-                }
-
-                if(status&(1<<18)) {
-#  ifdef dev_dbg_ratelimited
-                    dev_dbg_ratelimited(&board->pci_dev->dev, "ISR: Missed Previous Event\n");
-#  endif
-                }
-
-                /* clear waiting for ACK */
-                iowrite32(1<<16, board->bar0+USER_STATUS);
-
-                spin_lock_irqsave(&board->capture_queue.lock, flags);
-                board->capture_ready = 1;
-                wake_up_locked(&board->capture_queue);
-                spin_unlock_irqrestore(&board->capture_queue.lock, flags);
-            } else {
-#  ifdef dev_warn_ratelimited
-                dev_warn_ratelimited(&board->pci_dev->dev, "ISR: User IRQ w/o Event\n");
-#  endif
-            }
+            /* mask until amc_isr_thread() has copied the capture and ACK'd */
+            spin_lock_irqsave(&board->dma_queue.lock, flags);
+            if(!board->closing)
+                pico_wr32(board, INTR_DMA_DONE, INTR_ENABLE);
+            spin_unlock_irqrestore(&board->dma_queue.lock, flags);
+            ret = IRQ_WAKE_THREAD;
         }
 #endif
     }
 
-    iowrite32(active, board->bar0+INTR_CLEAR);
+    pico_wr32(board, active, INTR_CLEAR);
 
     {
         cycles_t tdelta = get_cycles()-tstart;
@@ -292,18 +371,174 @@ irqreturn_t amc_isr(int irq, void *dev_id)
         }
 
         atomic_inc(&board->num_isr);
+        pico_hist_since(&board->hist_isr, kstart);
+    }
+
+    {
+        unsigned long flags;
+
+        spin_lock_irqsave(&board->dma_queue.lock, flags);
+        pico_status_update(board, done, kstart);
+        spin_unlock_irqrestore(&board->dma_queue.lock, flags);
+    }
+
+    trace_pico_isr_exit(board, active, fifo, nbytes, ret);
+
+    /* no IRQ thread when polling */
+    if(ret==IRQ_WAKE_THREAD && board->irqmode==dmac_irq_poll)
+        ret = amc_isr_thread(irq, dev_id);
+
+    return ret;
+}
+
+#ifdef CONFIG_AMC_PICO_FRIB
+/* Copy the FRIB capture registers into the next ring slot.
+ * Runs after amc_isr() has masked INTR_USER.
+ */
+static
+void frib_capture_event(struct board_data *board)
+{
+    uint32_t status = ioread32(board->bar0+USER_STATUS);
+    struct pico_frib_event *evt = NULL;
+    unsigned long flags;
+    uint32_t i;
+
+    if(!(status&(1<<17))) { /* not waiting for ACK */
+#  ifdef dev_warn_ratelimited
+        dev_warn_ratelimited(&board->pci_dev->dev, "ISR: User IRQ w/o Event\n");
+#  endif
+        return;
     }
 
+    if(status&(1<<18)) {
+#  ifdef dev_dbg_ratelimited
+        dev_dbg_ratelimited(&board->pci_dev->dev, "ISR: Missed Previous Event\n");
+#  endif
+    }
+
+    spin_lock_irqsave(&board->capture_queue.lock, flags);
+    if(board->capture_nslots && board->capture_head-board->capture_tail < board->capture_nslots)
+        evt = frib_capture_slot(board, board->capture_head);
+    spin_unlock_irqrestore(&board->capture_queue.lock, flags);
+
+    if(evt) {
+        /* slot capture_head isn't visible to readers until published */
+        uint32_t *buf = (uint32_t*)(evt+1);
+        for(i=0; i<board->capture_length; i+=4) {
+            *buf++ = ioread32(board->bar0 + FRIB_CAP_FIRST + i);
+        }
+    }
+
+    /* clear waiting for ACK */
+    iowrite32(1<<16, board->bar0+USER_STATUS);
+
+    spin_lock_irqsave(&board->capture_queue.lock, flags);
+    if(status&(1<<18))
+        board->capture_lost++;
+    if(evt) {
+        evt->seq = board->capture_seq;
+        evt->lost = board->capture_lost;
+        evt->status = status;
+        evt->length = board->capture_length;
+        board->capture_lost = 0;
+        board->capture_head++;
+        wake_up_locked(&board->capture_queue);
+    } else {
+        /* ring full, reader too slow */
+        board->capture_lost++;
+    }
+    board->capture_seq++;
+    spin_unlock_irqrestore(&board->capture_queue.lock, flags);
+}
+#endif
+
+/* Slow part of interrupt handling, in process context */
+irqreturn_t amc_isr_thread(int irq, void *dev_id)
+{
+    struct board_data *board = (struct board_data *)dev_id;
+
+    if(0) {}
+#ifdef CONFIG_AMC_PICO_FRIB
+    else if(board->site==USER_SITE_FRIB) {
+        frib_capture_event(board);
+
+        pico_wr32(board, INTR_USER, INTR_CLEAR);
+
+        /* don't undo the masking by a concurrent remove() */
+        spin_lock_irq(&board->dma_queue.lock);
+        if(!board->closing)
+            pico_wr32(board, INTR_DMA_DONE|INTR_USER, INTR_ENABLE);
+        spin_unlock_irq(&board->dma_queue.lock);
+    }
+#endif
 
     return IRQ_HANDLED;
 }
 
+/* Hint that the acquisition IRQ be serviced by a CPU
+ * on the same NUMA node as the card and its DMA buffers.
+ */
+static
+void pico_irq_affinity(struct pci_dev *dev, struct board_data *board)
+{
+    int cpu;
+
+    board->irq_cpu = -1;
+    if(board->numa_node==NUMA_NO_NODE)
+        return;
+
+    cpu = cpumask_any_and(cpumask_of_node(board->numa_node), cpu_online_mask);
+    if(cpu>=nr_cpu_ids)
+        return;
+
+    if(irq_set_affinity_hint(dev->irq, cpumask_of(cpu))) {
+        dev_warn(&dev->dev, "Failed to set IRQ affinity hint\n");
+        return;
+    }
+    board->irq_cpu = cpu;
+    dev_info(&dev->dev, "NUMA node %d, IRQ hinted to CPU %d\n", board->numa_node, cpu);
+}
+
+static
+void pico_free_bufs(struct pci_dev *dev, struct board_data *board)
+{
+    unsigned i;
+
+    for (i = 0; i < DMA_BUF_COUNT; i++) {
+        if(!board->kernel_mem_buf[i]) continue;
+        dma_free_coherent(&dev->dev,
+                    DMA_BUF_SIZE,
+                    board->kernel_mem_buf[i],
+                    board->dma_buf[i]);
+        board->kernel_mem_buf[i] = NULL;
+    }
+}
+
+static
+int pico_alloc_bufs(struct pci_dev *dev, struct board_data *board)
+{
+    unsigned i;
+
+    for (i = 0; i < DMA_BUF_COUNT; i++) {
+        /* pages come from dev_to_node(), and may sleep unlike pci_alloc_consistent() */
+        board->kernel_mem_buf[i] = dma_alloc_coherent(&dev->dev, DMA_BUF_SIZE, &board->dma_buf[i], GFP_KERNEL);
+        if(!board->kernel_mem_buf[i]) {
+            dev_err(&dev->dev, "Failed to allocate DMA buffer %u\n", i);
+            pico_free_bufs(dev, board);
+            return -ENOMEM;
+        }
+
+        dev_dbg(&dev->dev, "pci_alloc() virt addr: %p\tsize: %u, phys addr: 0x%08llx\n",
+            board->kernel_mem_buf[i], (unsigned)DMA_BUF_SIZE, (unsigned long long)board->dma_buf[i]);
+    }
+    return 0;
+}
+
 static
 int pico_pci_setup(struct pci_dev *dev, struct board_data *board)
 {
 #define ERR(COND, LBL, MSG, ...) if(COND) { dev_err(&dev->dev, MSG, ##__VA_ARGS__); if(!ret) ret=-EIO; goto LBL; }
 
-    unsigned i;
     int ret;
 
     ret = pci_enable_device(dev);
@@ -322,18 +557,15 @@ int pico_pci_setup(struct pci_dev *dev, struct board_data *board)
 
     pci_set_master(dev);
 
+    board->fw_version = ioread32(board->bar0 + PICO_ADDR + FPGA_VER_OFFSET);
+
+    /* DMA engine only takes 32-bit addresses */
     ret = pci_set_dma_mask(dev, DMA_BIT_MASK(32));
     if(!ret) ret = pci_set_consistent_dma_mask(dev, DMA_BIT_MASK(32));
     ERR(ret, unmap2, "Failed to set DMA masks\n");
 
-    ret = -ENOMEM;
-    for (i = 0; i < DMA_BUF_COUNT; i++) {
-        board->kernel_mem_buf[i] = pci_alloc_consistent(dev, DMA_BUF_SIZE, &board->dma_buf[i]);
-        ERR(!board->kernel_mem_buf[i], freebufs, "Failed to allocate DMA buffer %u\n", i);
-
-        dev_dbg(&dev->dev, "pci_alloc() virt addr: %p\tsize: %u, phys addr: 0x%08llx\n",
-            board->kernel_mem_buf[i], (unsigned)DMA_BUF_SIZE, board->dma_buf[i]);
-    }
+    ret = pico_alloc_bufs(dev, board);
+    ERR(ret, unmap2, "Failed to allocate DMA buffers\n");
 
     if (board->irqmode==dmac_irq_msi) {
         ret = pci_enable_msi(dev);
@@ -341,8 +573,10 @@ int pico_pci_setup(struct pci_dev *dev, struct board_data *board)
     }
 
     if (board->irqmode!=dmac_irq_poll) {
-        ret = request_irq(dev->irq, &amc_isr, 0, "pico_acq", board);
+        ret = request_threaded_irq(dev->irq, &amc_isr, &amc_isr_thread, 0, "pico_acq", board);
         ERR(ret, msidisable, "Failed to attach acquire ISR\n");
+
+        pico_irq_affinity(dev, board);
     }
 
     return 0;
@@ -351,13 +585,7 @@ int pico_pci_setup(struct pci_dev *dev, struct board_data *board)
 msidisable:
     if (board->irqmode==dmac_irq_msi) pci_disable_msi(dev);
 freebufs:
-    for (i = 0; i < DMA_BUF_COUNT; i++) {
-        if(!board->kernel_mem_buf[i]) continue;
-        pci_free_consistent(	dev,
-                    DMA_BUF_SIZE,
-                    board->kernel_mem_buf[i],
-                    board->dma_buf[i]);
-    }
+    pico_free_bufs(dev, board);
 unmap2:
     pci_iounmap(dev, board->bar2);
 unmap0:
@@ -371,23 +599,51 @@ done:
 #undef ERR
 }
 
+#ifdef CONFIG_AMC_PICO_SIM
+/* In place of pico_pci_setup() for a simulated board.
+ * No IRQ, amc_isr() is called by the simulation, or polled.
+ */
+static
+int pico_sim_setup(struct pci_dev *dev, struct board_data *board)
+{
+    int ret;
+
+    ret = pico_sim_init(board);
+    if(ret)
+        return ret;
+
+    board->fw_version = ioread32(board->bar0 + PICO_ADDR + FPGA_VER_OFFSET);
+#ifdef CONFIG_AMC_PICO_FRIB
+    if(dmac_sim_frib)
+        iowrite32(0xb000, board->bar0 + FRIB_VERSION); /* detected in pico_probe() */
+#endif
+
+    ret = pico_alloc_bufs(dev, board);
+    if(ret)
+        pico_sim_fini(board);
+    return ret;
+}
+#endif
+
 static
 int pico_pci_cleanup(struct pci_dev *dev, struct board_data *board)
 {
-    unsigned i;
+#ifdef CONFIG_AMC_PICO_SIM
+    if(board->sim) {
+        pico_sim_fini(board);
+        pico_free_bufs(dev, board);
+        return 0;
+    }
+#endif
     if (board->irqmode!=dmac_irq_poll) {
+        if(board->irq_cpu>=0)
+            irq_set_affinity_hint(dev->irq, NULL);
         free_irq(dev->irq, board);
     }
     if (board->irqmode==dmac_irq_msi) {
         pci_disable_msi(dev);
     }
-    for (i = 0; i < DMA_BUF_COUNT; i++) {
-        if(!board->kernel_mem_buf[i]) continue;
-        pci_free_consistent(	dev,
-                    DMA_BUF_SIZE,
-                    board->kernel_mem_buf[i],
-                    board->dma_buf[i]);
-    }
+    pico_free_bufs(dev, board);
 
     pci_iounmap(dev, board->bar2);
     pci_iounmap(dev, board->bar0);
@@ -477,12 +733,160 @@ ssize_t cyclescal_show(struct device *dev, struct device_attribute *attr,
 static
 DEVICE_ATTR(cyclescal, 0444, cyclescal_show, NULL);
 
+/* not numa_node, which the PCI core already provides */
+static
+ssize_t dma_node_show(struct device *dev, struct device_attribute *attr,
+                     char *buf)
+{
+    struct board_data *board = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", board->numa_node);
+}
+
+static
+DEVICE_ATTR(dma_node, 0444, dma_node_show, NULL);
+
+static
+ssize_t irq_cpu_show(struct device *dev, struct device_attribute *attr,
+                     char *buf)
+{
+    struct board_data *board = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", board->irq_cpu);
+}
+
+static
+DEVICE_ATTR(irq_cpu, 0444, irq_cpu_show, NULL);
+
+static
+ssize_t pico_hist_show(struct pico_hist *hist, char *buf)
+{
+    ssize_t len = 0;
+    unsigned i;
+
+    /* "<lower bound ns> <count>" for non-empty buckets */
+    for(i=0; i<PICO_HIST_BUCKETS; i++) {
+        unsigned cnt = atomic_read(&hist->count[i]);
+        if(!cnt) continue;
+        len += scnprintf(buf+len, PAGE_SIZE-len, "%llu %u\n",
+                         i ? 1ull<<i : 0ull, cnt);
+    }
+    return len;
+}
+
+static
+void pico_hist_reset(struct pico_hist *hist)
+{
+    unsigned i;
+    for(i=0; i<PICO_HIST_BUCKETS; i++)
+        atomic_set(&hist->count[i], 0);
+}
+
+/* read histogram board->hist_NAME, any write clears */
+#define PICO_HIST_ATTR(NAME) \
+static \
+ssize_t hist_##NAME##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{ \
+    struct board_data *board = dev_get_drvdata(dev); \
+    return pico_hist_show(&board->hist_##NAME, buf); \
+} \
+static \
+ssize_t hist_##NAME##_store(struct device *dev, struct device_attribute *attr, \
+                            const char *buf, size_t count) \
+{ \
+    struct board_data *board = dev_get_drvdata(dev); \
+    pico_hist_reset(&board->hist_##NAME); \
+    return count; \
+} \
+static \
+DEVICE_ATTR(hist_##NAME, 0644, hist_##NAME##_show, hist_##NAME##_store)
+
+PICO_HIST_ATTR(isr);
+PICO_HIST_ATTR(wakeup);
+PICO_HIST_ATTR(arm);
+PICO_HIST_ATTR(copy);
+
+#undef PICO_HIST_ATTR
+
+/* read counter board->stat_NAME */
+#define PICO_STAT_ATTR(NAME) \
+static \
+ssize_t stat_##NAME##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{ \
+    struct board_data *board = dev_get_drvdata(dev); \
+    return sprintf(buf, "%llu\n", (unsigned long long)atomic64_read(&board->stat_##NAME)); \
+} \
+static \
+DEVICE_ATTR(stat_##NAME, 0444, stat_##NAME##_show, NULL)
+
+PICO_STAT_ATTR(bytes);
+PICO_STAT_ATTR(reads);
+PICO_STAT_ATTR(aborts);
+PICO_STAT_ATTR(cancelled);
+PICO_STAT_ATTR(fifo_runaway);
+PICO_STAT_ATTR(empty_done);
+PICO_STAT_ATTR(short_xfer);
+
+#undef PICO_STAT_ATTR
+
+/* read the last report, write anything to run BIST() */
+static
+ssize_t bist_show(struct device *dev, struct device_attribute *attr,
+                  char *buf)
+{
+    struct board_data *board = dev_get_drvdata(dev);
+    ssize_t ret = 0;
+
+    mutex_lock(&board->bist_lock);
+    if(board->bist_report)
+        ret = scnprintf(buf, PAGE_SIZE, "%s", board->bist_report);
+    mutex_unlock(&board->bist_lock);
+    return ret;
+}
+
+static
+ssize_t bist_store(struct device *dev, struct device_attribute *attr,
+                   const char *buf, size_t count)
+{
+    struct board_data *board = dev_get_drvdata(dev);
+    ssize_t ret;
+
+    if(mutex_lock_interruptible(&board->bist_lock))
+        return -ERESTARTSYS;
+
+    if(!board->bist_report)
+        board->bist_report = kzalloc(PAGE_SIZE, GFP_KERNEL);
+
+    if(!board->bist_report)
+        ret = -ENOMEM;
+    else
+        ret = BIST(board, board->bist_report, PAGE_SIZE);
+
+    mutex_unlock(&board->bist_lock);
+    return ret<0 ? ret : count;
+}
+
+static
+DEVICE_ATTR(bist, 0644, bist_show, bist_store);
+
 static
 struct attribute * pico_attrs[] = {
     &dev_attr_lastisr.attr,
     &dev_attr_numisr.attr,
     &dev_attr_longestisr.attr,
     &dev_attr_cyclescal.attr,
+    &dev_attr_dma_node.attr,
+    &dev_attr_irq_cpu.attr,
+    &dev_attr_hist_isr.attr,
+    &dev_attr_hist_wakeup.attr,
+    &dev_attr_hist_arm.attr,
+    &dev_attr_hist_copy.attr,
+    &dev_attr_stat_bytes.attr,
+    &dev_attr_stat_reads.attr,
+    &dev_attr_stat_aborts.attr,
+    &dev_attr_stat_cancelled.attr,
+    &dev_attr_stat_fifo_runaway.attr,
+    &dev_attr_stat_empty_done.attr,
+    &dev_attr_stat_short_xfer.attr,
+    &dev_attr_bist.attr,
     NULL
 };
 ATTRIBUTE_GROUPS(pico);
@@ -493,10 +897,18 @@ void pico_release(struct kobject *obj)
     struct board_data *board = container_of(obj, struct board_data, kobj);
 
     mutex_destroy(&board->ddr_lock);
+    mutex_destroy(&board->reg_lock);
+    mutex_destroy(&board->bist_lock);
+    kfree(board->bist_report);
+    kfree(board->ddr_buffer);
+    free_page((unsigned long)board->status);
+#ifdef CONFIG_AMC_PICO_FRIB
+    mutex_destroy(&board->capture_read_lock);
+#endif
 
     /* Free allocated memory */
 #ifdef CONFIG_AMC_PICO_FRIB
-    kfree(board->capture_buf);
+    vfree(board->capture_buf);
 #endif
     kfree(board);
 }
@@ -576,14 +988,8 @@ void pico_cdev_cleanup(struct pci_dev *dev, struct board_data *board)
     sysfs_remove_groups(&dev->dev.kobj, pico_groups);
 }
 
-/**
- * \brief Claims control of PCI device
- * \param dev   PCI device (bus, ...)
- * \param id    Device data (vendor, device, subvendor, subdevice...)
- * \return      0 on success, negative on fail
- */
-
-static int probe(struct pci_dev *dev, const struct pci_device_id *id)
+/* Real (sim==0) or simulated board */
+static int pico_probe(struct pci_dev *dev, int sim)
 {
     int ret;
     struct board_data *board = NULL;
@@ -592,7 +998,7 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
              dev->slot ? pci_slot_name(dev->slot) : "<no slot>");
 
 	/* Allocate memory for board structure */
-	board = kzalloc(sizeof(struct board_data), GFP_KERNEL);
+	board = kzalloc_node(sizeof(struct board_data), GFP_KERNEL, dev_to_node(&dev->dev));
 	if (!board) {
 		return -ENOMEM;
 	}
@@ -604,10 +1010,25 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
     }
     /* henceforth must call kobject_put(board) for cleanup */
 
+    board->status = (struct pico_status*)get_zeroed_page(GFP_KERNEL);
+    if(!board->status) {
+        kobject_put(&board->kobj);
+        return -ENOMEM;
+    }
+
     mutex_init(&board->ddr_lock);
+    spin_lock_init(&board->ddr_map_lock);
+    mutex_init(&board->reg_lock);
+    board->ddr_cur_page = (uint32_t)-1;
+    mutex_init(&board->bist_lock);
+#ifdef CONFIG_AMC_PICO_FRIB
+    mutex_init(&board->capture_read_lock);
+#endif
 
     board->site = USER_SITE_NONE;
 	board->pci_dev = dev;
+    board->numa_node = dev_to_node(&dev->dev);
+    board->irq_cpu = -1;
     board->irqmode = dmac_irqmode;
     if (board->irqmode>2)
         board->irqmode = 2;
@@ -617,9 +1038,14 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
 
     init_waitqueue_head(&board->dma_queue);
 
-    ret = pico_pci_setup(dev, board);
+#ifdef CONFIG_AMC_PICO_SIM
+    if(sim)
+        ret = pico_sim_setup(dev, board);
+    else
+#endif
+        ret = pico_pci_setup(dev, board);
     if(!ret) {
-        uint32_t fwver = ioread32(board->bar0 + PICO_ADDR + FPGA_VER_OFFSET);
+        uint32_t fwver = board->fw_version;
         dev_info(&dev->dev, "FPGA FW version = %08x\n",
             fwver);
         dev_info(&dev->dev, "FPGA FW timestamp = %d\n",
@@ -632,6 +1058,7 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
         } else {
 
             dma_reset(board);
+            pico_regs_resync(board);
             ret = pico_cdev_setup(dev, board);
         }
 
@@ -654,28 +1081,44 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
                 init_waitqueue_head(&board->capture_queue);
 
                 board->capture_length = FRIB_CAP_LAST-FRIB_CAP_FIRST+4;
-                board->capture_buf = kmalloc(4*board->capture_length, GFP_KERNEL);
+                /* power of 2 so slot index survives wrap of capture_head */
+                board->capture_nslots = roundup_pow_of_two(clamp(dmac_capture_slots, 2u, 1u<<20));
+                board->capture_buf = vmalloc_node(board->capture_nslots*frib_capture_slot_size(board),
+                                                  board->numa_node);
                 if(!board->capture_buf) {
+                    board->capture_nslots = 0;
                     board->capture_length = 0;
                     dev_err(&dev->dev, "FRIB capture buffer alloc fails.  Capture disabled.\n");
                 }
 
                 mb();
-                iowrite32(INTR_DMA_DONE|INTR_USER, board->bar0+INTR_CLEAR);
-                iowrite32(INTR_DMA_DONE|INTR_USER, board->bar0+INTR_ENABLE);
+                pico_wr32(board, INTR_DMA_DONE|INTR_USER, INTR_CLEAR);
+                pico_wr32(board, INTR_DMA_DONE|INTR_USER, INTR_ENABLE);
             }
         }
 #endif
         if(board->site==USER_SITE_NONE) {
             mb();
-            iowrite32(INTR_DMA_DONE, board->bar0+INTR_CLEAR);
-            iowrite32(INTR_DMA_DONE, board->bar0+INTR_ENABLE);
+            pico_wr32(board, INTR_DMA_DONE, INTR_CLEAR);
+            pico_wr32(board, INTR_DMA_DONE, INTR_ENABLE);
         }
     }
     if(ret) kobject_put(&board->kobj);
     return ret;
 }
 
+/**
+ * \brief Claims control of PCI device
+ * \param dev   PCI device (bus, ...)
+ * \param id    Device data (vendor, device, subvendor, subdevice...)
+ * \return      0 on success, negative on fail
+ */
+
+static int probe(struct pci_dev *dev, const struct pci_device_id *id)
+{
+    return pico_probe(dev, 0);
+}
+
 /**
  * \brief  Cleans PCI device things
  * \param	dev	PCI device (bus, ...)
@@ -685,7 +1128,11 @@ static void remove(struct pci_dev *dev)
 {
 	struct board_data *board = dev_get_drvdata(&dev->dev);
 
-    iowrite32(0, board->bar0+INTR_ENABLE);
+    /* amc_isr_thread() may still run until free_irq() */
+    spin_lock_irq(&board->dma_queue.lock);
+    board->closing = 1;
+    pico_wr32(board, 0, INTR_ENABLE);
+    spin_unlock_irq(&board->dma_queue.lock);
 	dev_info(&dev->dev, " remove()\n");
     pico_cdev_cleanup(dev, board);
     pico_pci_cleanup(dev, board);
@@ -702,6 +1149,45 @@ static struct pci_driver pci_driver = {
 	.remove = remove,
 };
 
+#ifdef CONFIG_AMC_PICO_SIM
+static
+void pico_sim_add_boards(void)
+{
+    unsigned i;
+
+    if(!dmac_sim_boards || pico_sim_register())
+        return;
+
+    for(i=0; i<dmac_sim_boards && i<PICO_SIM_MAX_BOARDS; i++) {
+        struct pci_dev *dev = pico_sim_dev_alloc(i);
+
+        if(IS_ERR(dev)) {
+            printk(KERN_ERR MOD_NAME ": Failed to create simulated board %u\n", i);
+            break;
+        }
+        if(pico_probe(dev, 1)) {
+            pico_sim_dev_free(dev);
+            break;
+        }
+        sim_devs[i] = dev;
+    }
+}
+
+static
+void pico_sim_remove_boards(void)
+{
+    unsigned i;
+
+    for(i=0; i<PICO_SIM_MAX_BOARDS; i++) {
+        if(!sim_devs[i]) continue;
+        remove(sim_devs[i]);
+        pico_sim_dev_free(sim_devs[i]);
+        sim_devs[i] = NULL;
+    }
+    pico_sim_unregister();
+}
+#endif
+
 static
 void print_all_ioctls(void){
     printk(KERN_DEBUG MOD_NAME
@@ -733,7 +1219,8 @@ static int __init damc_fmc25_pcie_init(void)
 {
 	int rc = 0;
 
-	damc_dma_buf_len = damc_req_dma_buf_len;
+	/* whole pages, so that buffers may be mmap()'d */
+	damc_dma_buf_len = PAGE_ALIGN(damc_req_dma_buf_len);
 
 	printk(KERN_DEBUG "===============================================\n");
 	printk(KERN_DEBUG "              CAEN ELS AMC-PICO8               \n");
@@ -742,6 +1229,9 @@ static int __init damc_fmc25_pcie_init(void)
     printk(KERN_DEBUG MOD_NAME " init(), built " AMC_PICO_VERSION "\n");
 #ifdef CONFIG_AMC_PICO_FRIB
     printk(KERN_DEBUG "Includes \"frib\" site FW support.\n");
+#endif
+#ifdef CONFIG_AMC_PICO_SIM
+    printk(KERN_DEBUG "Includes simulated boards.\n");
 #endif
     printk(KERN_DEBUG "===============================================\n");
 
@@ -761,6 +1251,10 @@ static int __init damc_fmc25_pcie_init(void)
 	rc = pci_register_driver(&pci_driver);
 	if(rc)
 		class_destroy(amc_pico8_class);
+#ifdef CONFIG_AMC_PICO_SIM
+	else
+		pico_sim_add_boards();
+#endif
 	return rc;
 }
 
@@ -770,6 +1264,9 @@ static int __init damc_fmc25_pcie_init(void)
 static void __exit damc_fmc25_pcie_exit(void)
 {
 	printk(KERN_DEBUG MOD_NAME " exit()\n");
+#ifdef CONFIG_AMC_PICO_SIM
+	pico_sim_remove_boards();
+#endif
 	pci_unregister_driver(&pci_driver);
 	class_destroy(amc_pico8_class);
 }
@@ -0,0 +1,435 @@
+/*
+ * AMC-Pico8 Linux Driver
+ *
+ *  Copyright 2016 Board of Trustees of Michigan State University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License v2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/highmem.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "amc_pico_sim.h"
+#include "amc_pico_regs.h"
+
+/* resources of simulated boards */
+#define PICO_SIM_BAR0_LEN	(0x80000)
+#define PICO_SIM_BAR2_LEN	(0x10000)
+/* found at FPGA_VER_OFFSET */
+#define PICO_SIM_FW_VERSION	(0x0001000b)
+/* found at INTR_ID */
+#define PICO_SIM_INTR_ID	(0x157C5721)
+
+struct pico_sim_cmd {
+    dma_addr_t addr;
+    uint32_t len;
+    unsigned irq;
+};
+
+struct pico_sim_resp {
+    uint32_t len;
+    uint32_t addr;
+};
+
+struct pico_sim {
+    struct board_data *board;
+    /* taken inside dma_queue.lock */
+    spinlock_t lock;
+    /* executes the command at cmd_tail */
+    struct delayed_work work;
+    unsigned scheduled;
+    unsigned dead;
+
+    /* latched by DMA_OFFSET_ADDR and DMA_OFFSET_LEN */
+    uint32_t addr, len;
+    uint32_t control;
+    /* incremented by DMA_CTRL_MASK_RESET */
+    unsigned gen;
+
+    /* FIFOs hold [tail, head) */
+    struct pico_sim_cmd cmd[PICO_SIM_FIFO];
+    unsigned cmd_head, cmd_tail;
+    struct pico_sim_resp resp[PICO_SIM_FIFO];
+    unsigned resp_head, resp_tail;
+
+    uint32_t intr_latch, intr_enable;
+
+    /* next word written */
+    uint32_t counter;
+    /* PRBS31 state.  Only used by pico_sim_work() */
+    uint32_t prbs;
+    /* ktime_get() ns since enabled with no commands queued, or 0 */
+    u64 idle_ns;
+};
+
+static
+struct device *pico_sim_root;
+
+/* Sample rate from PICO_CONV_GEN, in bytes per second */
+static
+u64 pico_sim_rate(struct board_data *board)
+{
+    uint32_t conv_gen = ioread32(board->bar0 + PICO_ADDR + PICO_CONV_GEN),
+             fsamp = conv_gen<PICO_CLK_FREQ ? PICO_CLK_FREQ / (conv_gen + 1) : 1;
+
+    return (u64)fsamp * 8 * 4;
+}
+
+/* Start the command at cmd_tail if possible.
+ * Call with sim->lock held
+ */
+static
+void pico_sim_kick(struct pico_sim *sim)
+{
+    struct board_data *board = sim->board;
+    u64 rate, us;
+
+    if(sim->dead || sim->scheduled || !(sim->control&DMA_CTRL_MASK_ENABLE)
+            || sim->cmd_head==sim->cmd_tail
+            || sim->resp_head-sim->resp_tail>=PICO_SIM_FIFO)
+        return;
+
+    rate = pico_sim_rate(board);
+
+    if(sim->idle_ns) {
+        /* samples which arrived while there was nowhere to put them */
+        u64 idle_us = div_u64(ktime_to_ns(ktime_get())-sim->idle_ns, 1000);
+        if(idle_us>1000000000ull)
+            idle_us = 1000000000ull;
+        sim->counter += (uint32_t)div_u64(idle_us*(rate/4), 1000000);
+        sim->idle_ns = 0;
+    }
+
+    us = div64_u64((u64)sim->cmd[sim->cmd_tail%PICO_SIM_FIFO].len*1000000, rate);
+    sim->scheduled = 1;
+    schedule_delayed_work(&sim->work, usecs_to_jiffies(us));
+}
+
+/* Next 32 bits of PRBS31 (x^31 + x^28 + 1), first bit in the MSB */
+static
+uint32_t pico_sim_prbs(uint32_t *state)
+{
+    uint32_t s = *state, w = 0;
+    unsigned i;
+
+    for(i=0; i<32; i++) {
+        uint32_t bit = ((s>>30)^(s>>27))&1;
+        s = ((s<<1)|bit)&0x7fffffff;
+        w = (w<<1)|bit;
+    }
+    *state = s;
+    return w;
+}
+
+/* Write len bytes to bus address addr.  Words continue the PRBS in *prbs,
+ * or if NULL, the counter starting from 'first'.
+ */
+static
+void pico_sim_fill(struct pico_sim *sim, dma_addr_t addr, uint32_t len, uint32_t first, uint32_t *prbs)
+{
+    /* The device has no IOMMU, so bus addresses are physical */
+    while(len) {
+        unsigned off = addr & ~PAGE_MASK, i;
+        uint32_t n = min_t(uint32_t, len, PAGE_SIZE-off);
+        char *page = kmap_atomic(pfn_to_page(addr>>PAGE_SHIFT));
+
+        for(i=0; i+4<=n; i+=4)
+            *(uint32_t*)(page+off+i) = prbs ? pico_sim_prbs(prbs) : first++;
+        if(i<n) {
+            uint32_t last = prbs ? pico_sim_prbs(prbs) : first++;
+            memcpy(page+off+i, &last, n-i);
+        }
+
+        kunmap_atomic(page);
+        addr += n;
+        len -= n;
+    }
+}
+
+/* The DMA engine completes the command at cmd_tail */
+static
+void pico_sim_work(struct work_struct *work)
+{
+    struct pico_sim *sim = container_of(to_delayed_work(work), struct pico_sim, work);
+    struct board_data *board = sim->board;
+    struct pico_sim_cmd cmd;
+    unsigned long flags;
+    unsigned gen;
+    uint32_t first;
+    int raise = 0;
+
+    spin_lock_irqsave(&sim->lock, flags);
+    sim->scheduled = 0;
+    if(sim->dead || !(sim->control&DMA_CTRL_MASK_ENABLE) || sim->cmd_head==sim->cmd_tail) {
+        spin_unlock_irqrestore(&sim->lock, flags);
+        return;
+    }
+    cmd = sim->cmd[sim->cmd_tail%PICO_SIM_FIFO];
+    gen = sim->gen;
+    first = sim->counter;
+    sim->counter += (cmd.len+3)/4;
+    spin_unlock_irqrestore(&sim->lock, flags);
+
+    /* the command isn't complete until the response is queued */
+    pico_sim_fill(sim, cmd.addr, cmd.len, first,
+                  ioread32(board->bar0 + MUX_ADDR)==1 ? &sim->prbs : NULL);
+
+    spin_lock_irqsave(&sim->lock, flags);
+    if(gen==sim->gen) {
+        struct pico_sim_resp *resp = &sim->resp[sim->resp_head++%PICO_SIM_FIFO];
+
+        resp->len = cmd.len;
+        resp->addr = lower_32_bits(cmd.addr);
+        sim->cmd_tail++;
+        if(cmd.irq)
+            sim->intr_latch |= INTR_DMA_DONE;
+        if(sim->cmd_head==sim->cmd_tail)
+            sim->idle_ns = ktime_to_ns(ktime_get());
+    }
+    /* polled mode calls amc_isr() itself */
+    raise = (sim->intr_latch&sim->intr_enable) && board->irqmode!=dmac_irq_poll;
+    pico_sim_kick(sim);
+    spin_unlock_irqrestore(&sim->lock, flags);
+
+    if(raise) {
+        /* as if from hard IRQ context */
+        local_irq_save(flags);
+        amc_isr(board->pci_dev->irq, board);
+        local_irq_restore(flags);
+    }
+}
+
+uint32_t pico_sim_read(struct board_data *board, unsigned offset)
+{
+    struct pico_sim *sim = board->sim;
+    unsigned long flags;
+    uint32_t val = 0;
+
+    spin_lock_irqsave(&sim->lock, flags);
+    switch(offset) {
+    case DMA_ADDR+DMA_OFFSET_STATUS:
+        val = min_t(unsigned, sim->resp_head-sim->resp_tail, 0x7FF) << 16;
+        break;
+    case DMA_ADDR+DMA_OFFSET_CONTROL:
+        val = sim->control;
+        break;
+    case DMA_ADDR+DMA_OFFSET_ADDR:
+        val = sim->addr;
+        break;
+    case DMA_ADDR+DMA_OFFSET_LEN:
+        val = sim->len;
+        break;
+    case DMA_ADDR+DMA_OFFSET_RESP_LEN:
+        if(sim->resp_head!=sim->resp_tail)
+            val = sim->resp[sim->resp_tail%PICO_SIM_FIFO].len;
+        break;
+    case DMA_ADDR+DMA_OFFSET_RESP_ADDR:
+        if(sim->resp_head!=sim->resp_tail)
+            val = sim->resp[sim->resp_tail%PICO_SIM_FIFO].addr;
+        break;
+    case INTR_ID:
+        val = PICO_SIM_INTR_ID;
+        break;
+    case INTR_STATUS:
+        val = sim->intr_latch ? INTR_STATUS_ACT : 0;
+        if(board->irqmode==dmac_irq_msi)
+            val |= INTR_STATUS_MSI_EN;
+        break;
+    case INTR_LATCH:
+        val = sim->intr_latch;
+        break;
+    case INTR_ENABLE:
+        val = sim->intr_enable;
+        break;
+    default:
+        WARN_ONCE(1, "PICO8 sim read of unknown register %05x\n", offset);
+    }
+    spin_unlock_irqrestore(&sim->lock, flags);
+    return val;
+}
+
+void pico_sim_write(struct board_data *board, uint32_t val, unsigned offset)
+{
+    struct pico_sim *sim = board->sim;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sim->lock, flags);
+    switch(offset) {
+    case DMA_ADDR+DMA_OFFSET_CONTROL:
+        if(val&DMA_CTRL_MASK_RESET) {
+            /* flush both FIFOs, and forget any command in progress */
+            sim->cmd_head = sim->cmd_tail = 0;
+            sim->resp_head = sim->resp_tail = 0;
+            sim->control = 0;
+            sim->idle_ns = 0;
+            sim->gen++;
+        } else {
+            if((val&DMA_CTRL_MASK_ENABLE) && sim->cmd_head==sim->cmd_tail)
+                sim->idle_ns = ktime_to_ns(ktime_get());
+            sim->control = val;
+            pico_sim_kick(sim);
+        }
+        break;
+    case DMA_ADDR+DMA_OFFSET_CMD:
+        if(!(val&DMA_CMD_MASK_DMA_GO)) {
+            /* no-op */
+        } else if(sim->cmd_head-sim->cmd_tail>=PICO_SIM_FIFO) {
+            WARN_ONCE(1, "PICO8 sim command FIFO overflow\n");
+        } else {
+            struct pico_sim_cmd *cmd = &sim->cmd[sim->cmd_head++%PICO_SIM_FIFO];
+
+            cmd->addr = sim->addr;
+            cmd->len = sim->len;
+            cmd->irq = !!(val&DMA_CMD_MASK_GEN_IRQ);
+            pico_sim_kick(sim);
+        }
+        break;
+    case DMA_ADDR+DMA_OFFSET_ADDR:
+        sim->addr = val;
+        break;
+    case DMA_ADDR+DMA_OFFSET_LEN:
+        sim->len = val;
+        break;
+    case DMA_ADDR+DMA_OFFSET_RESP_LEN:
+        /* pop */
+        if(sim->resp_head!=sim->resp_tail)
+            sim->resp_tail++;
+        pico_sim_kick(sim);
+        break;
+    case INTR_CLEAR:
+        sim->intr_latch &= ~val;
+        break;
+    case INTR_ENABLE:
+        sim->intr_enable = val;
+        break;
+    default:
+        WARN_ONCE(1, "PICO8 sim write of unknown register %05x\n", offset);
+    }
+    spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+int pico_sim_register(void)
+{
+    pico_sim_root = root_device_register(MOD_NAME "_sim");
+    if(IS_ERR(pico_sim_root)) {
+        int ret = PTR_ERR(pico_sim_root);
+        pico_sim_root = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+void pico_sim_unregister(void)
+{
+    if(pico_sim_root)
+        root_device_unregister(pico_sim_root);
+    pico_sim_root = NULL;
+}
+
+static
+void pico_sim_dev_release(struct device *dev)
+{
+    kfree(container_of(dev, struct pci_dev, dev));
+}
+
+struct pci_dev *pico_sim_dev_alloc(unsigned n)
+{
+    struct pci_dev *dev;
+    int ret;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if(!dev)
+        return ERR_PTR(-ENOMEM);
+
+    device_initialize(&dev->dev);
+    dev->dev.parent = pico_sim_root;
+    dev->dev.release = pico_sim_dev_release;
+    dev->dma_mask = DMA_BIT_MASK(32);
+    dev->dev.dma_mask = &dev->dma_mask;
+    dev->dev.coherent_dma_mask = DMA_BIT_MASK(32);
+
+    /* only the lengths are meaningful */
+    dev->resource[0].end = PICO_SIM_BAR0_LEN-1;
+    dev->resource[0].flags = IORESOURCE_MEM;
+    dev->resource[2].end = PICO_SIM_BAR2_LEN-1;
+    dev->resource[2].flags = IORESOURCE_MEM;
+
+    ret = dev_set_name(&dev->dev, "sim%u", n);
+    if(!ret)
+        ret = device_add(&dev->dev);
+    if(ret) {
+        put_device(&dev->dev);
+        return ERR_PTR(ret);
+    }
+    return dev;
+}
+
+void pico_sim_dev_free(struct pci_dev *dev)
+{
+    device_unregister(&dev->dev);
+}
+
+int pico_sim_init(struct board_data *board)
+{
+    struct pci_dev *dev = board->pci_dev;
+    struct pico_sim *sim;
+
+    sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+    if(!sim)
+        return -ENOMEM;
+
+    sim->board = board;
+    spin_lock_init(&sim->lock);
+    INIT_DELAYED_WORK(&sim->work, pico_sim_work);
+    sim->prbs = 0x7fffffff;
+
+    board->bar0 = (char __iomem *)vzalloc(pci_resource_len(dev, 0));
+    board->bar2 = (char __iomem *)vzalloc(pci_resource_len(dev, 2));
+    if(!board->bar0 || !board->bar2) {
+        vfree((void*)board->bar0);
+        vfree((void*)board->bar2);
+        kfree(sim);
+        return -ENOMEM;
+    }
+
+    iowrite32(PICO_SIM_FW_VERSION, board->bar0 + PICO_ADDR + FPGA_VER_OFFSET);
+
+    board->sim = sim;
+    dev_info(&dev->dev, "Simulated board\n");
+    return 0;
+}
+
+void pico_sim_fini(struct board_data *board)
+{
+    struct pico_sim *sim = board->sim;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sim->lock, flags);
+    sim->dead = 1;
+    spin_unlock_irqrestore(&sim->lock, flags);
+
+    /* no more calls to amc_isr() */
+    cancel_delayed_work_sync(&sim->work);
+
+    vfree((void*)board->bar0);
+    vfree((void*)board->bar2);
+    board->bar2 = board->bar0 = NULL;
+    board->sim = NULL;
+    kfree(sim);
+}
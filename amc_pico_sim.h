@@ -0,0 +1,81 @@
+/*
+ * AMC-Pico8 Linux Driver
+ *
+ *  Copyright 2016 Board of Trustees of Michigan State University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License v2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ * \brief Software stand-in for the card, for testing without hardware
+ *
+ * Built with CONFIG_AMC_PICO_SIM.  Loading with sim_boards=N creates N
+ * simulated boards alongside any real ones, with the same char. devices
+ * (eg. /dev/amc_pico_sim0).
+ *
+ * The DMA_ADDR and INTR_ADDR registers are modeled, and are reached through
+ * pico_rd32()/pico_wr32().  Other BAR0 registers, and BAR2, are ordinary
+ * memory which reads back what was written.
+ *
+ * The DMA engine executes queued commands in order, at the rate implied by
+ * PICO_CONV_GEN (8 channels of 4 bytes per sample).  Each command
+ * is completed in full, and writes consecutive 32-bit words of a counter,
+ * which continues from one command to the next.  While enabled with
+ * the command FIFO empty, the counter still advances, so samples lost
+ * to a slow reader show up as a gap.
+ *
+ * When MUX_ADDR is 1, as set by BIST(), commands are filled with PRBS31
+ * (x^31 + x^28 + 1) instead, 32 bits per word.
+ */
+
+#ifndef AMC_PICO_SIM_H_
+#define AMC_PICO_SIM_H_
+
+#include <linux/kernel.h>
+#include <linux/pci.h>
+
+#include "amc_pico_internal.h"
+
+/** Most simulated boards which may be created */
+#define PICO_SIM_MAX_BOARDS	(4)
+
+/** Depth of the simulated command and response FIFOs */
+#define PICO_SIM_FIFO		(DMA_CMD_RING)
+
+/** Register /sys/devices/amc_pico_sim, the parent of simulated boards */
+int pico_sim_register(void);
+void pico_sim_unregister(void);
+
+/**
+ * \brief Create the device of simulated board n
+ * \return the new device, or ERR_PTR()
+ *
+ * Looks enough like a struct pci_dev, with BAR0 and BAR2 resources,
+ * for board_data->pci_dev.  None of the PCI core functions may be called on it.
+ */
+struct pci_dev *pico_sim_dev_alloc(unsigned n);
+void pico_sim_dev_free(struct pci_dev *dev);
+
+/**
+ * \brief Attach a simulated card to board
+ *
+ * In place of pico_pci_setup(), maps BAR0 and BAR2 to memory,
+ * and sets board->sim.
+ */
+int pico_sim_init(struct board_data *board);
+
+/** \brief Stop the simulated card, and free what pico_sim_init() allocated */
+void pico_sim_fini(struct board_data *board);
+
+#endif /* AMC_PICO_SIM_H_ */
@@ -0,0 +1,178 @@
+/*
+ * AMC-Pico8 Linux Driver
+ *
+ *  Copyright 2016 Board of Trustees of Michigan State University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License v2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ * \brief Tracepoints along the acquisition path
+ *
+ * Enable with eg.
+ *   echo 1 > /sys/kernel/debug/tracing/events/amc_pico/enable
+ *
+ * Defined in amc_pico_main.c with CREATE_TRACE_POINTS
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM amc_pico
+
+#if !defined(AMC_PICO_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AMC_PICO_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#include "amc_pico_internal.h"
+
+TRACE_EVENT(pico_dma_push,
+    TP_PROTO(struct board_data *board, dma_addr_t addr, uint32_t len, int gen_irq),
+    TP_ARGS(board, addr, len, gen_irq),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(&board->pci_dev->dev))
+        __field(unsigned, seq)
+        __field(u64, addr)
+        __field(uint32_t, len)
+        __field(int, gen_irq)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(&board->pci_dev->dev));
+        __entry->seq = board->dma_pushed;
+        __entry->addr = addr;
+        __entry->len = len;
+        __entry->gen_irq = gen_irq;
+    ),
+    TP_printk("%s seq=%u addr=0x%llx len=%u irq=%d", __get_str(dev),
+              __entry->seq, (unsigned long long)__entry->addr,
+              (unsigned)__entry->len, __entry->gen_irq)
+);
+
+TRACE_EVENT(pico_dma_enable,
+    TP_PROTO(struct board_data *board, int enable),
+    TP_ARGS(board, enable),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(&board->pci_dev->dev))
+        __field(int, enable)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(&board->pci_dev->dev));
+        __entry->enable = enable;
+    ),
+    TP_printk("%s enable=%d", __get_str(dev), __entry->enable)
+);
+
+/* sequence counters before the reset */
+TRACE_EVENT(pico_dma_reset,
+    TP_PROTO(struct board_data *board),
+    TP_ARGS(board),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(&board->pci_dev->dev))
+        __field(unsigned, pushed)
+        __field(unsigned, completed)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(&board->pci_dev->dev));
+        __entry->pushed = board->dma_pushed;
+        __entry->completed = board->dma_completed;
+    ),
+    TP_printk("%s pushed=%u completed=%u", __get_str(dev),
+              __entry->pushed, __entry->completed)
+);
+
+TRACE_EVENT(pico_isr_enter,
+    TP_PROTO(struct board_data *board, uint32_t active),
+    TP_ARGS(board, active),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(&board->pci_dev->dev))
+        __field(uint32_t, active)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(&board->pci_dev->dev));
+        __entry->active = active;
+    ),
+    TP_printk("%s latch=0x%08x", __get_str(dev), (unsigned)__entry->active)
+);
+
+/* fifo is the response FIFO count on DMA_DONE, nbytes the sum of responses popped */
+TRACE_EVENT(pico_isr_exit,
+    TP_PROTO(struct board_data *board, uint32_t active, uint32_t fifo, size_t nbytes, int ret),
+    TP_ARGS(board, active, fifo, nbytes, ret),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(&board->pci_dev->dev))
+        __field(uint32_t, active)
+        __field(uint32_t, fifo)
+        __field(size_t, nbytes)
+        __field(unsigned, completed)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(&board->pci_dev->dev));
+        __entry->active = active;
+        __entry->fifo = fifo;
+        __entry->nbytes = nbytes;
+        __entry->completed = board->dma_completed;
+        __entry->ret = ret;
+    ),
+    TP_printk("%s latch=0x%08x fifo=%u nbytes=%zu completed=%u ret=%d", __get_str(dev),
+              (unsigned)__entry->active, (unsigned)__entry->fifo, __entry->nbytes,
+              __entry->completed, __entry->ret)
+);
+
+/* a reader waiting in pico_wait_locked() has run */
+TRACE_EVENT(pico_read_wakeup,
+    TP_PROTO(struct board_data *board, int rc),
+    TP_ARGS(board, rc),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(&board->pci_dev->dev))
+        __field(unsigned, pushed)
+        __field(unsigned, completed)
+        __field(unsigned, flag)
+        __field(int, rc)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(&board->pci_dev->dev));
+        __entry->pushed = board->dma_pushed;
+        __entry->completed = board->dma_completed;
+        __entry->flag = board->dma_irq_flag;
+        __entry->rc = rc;
+    ),
+    TP_printk("%s pushed=%u completed=%u flag=%u rc=%d", __get_str(dev),
+              __entry->pushed, __entry->completed, __entry->flag, __entry->rc)
+);
+
+/* copy_to_user() of DMA data finished.  left is bytes not copied */
+TRACE_EVENT(pico_copy_done,
+    TP_PROTO(struct board_data *board, unsigned long len, unsigned long left),
+    TP_ARGS(board, len, left),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(&board->pci_dev->dev))
+        __field(unsigned long, len)
+        __field(unsigned long, left)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(&board->pci_dev->dev));
+        __entry->len = len;
+        __entry->left = left;
+    ),
+    TP_printk("%s len=%lu left=%lu", __get_str(dev), __entry->len, __entry->left)
+);
+
+#endif /* AMC_PICO_TRACE_H_ */
+
+/* must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE amc_pico_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,186 @@
+/*
+ * AMC-Pico8 Linux Driver
+ *
+ *  Copyright 2016 Board of Trustees of Michigan State University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License v2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/err.h>
+#include <linux/dma-mapping.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE>=KERNEL_VERSION(4,11,0)
+#  include <linux/sched/mm.h>
+#else
+#  define mmgrab(mm) atomic_inc(&(mm)->mm_count)
+#endif
+
+#include "amc_pico_ubuf.h"
+
+/* charge or uncharge npages to RLIMIT_MEMLOCK, as mlock() would */
+static
+int pico_ubuf_account(struct mm_struct *mm, unsigned long npages, bool inc)
+{
+#if LINUX_VERSION_CODE>=KERNEL_VERSION(5,2,0)
+    return account_locked_vm(mm, npages, inc);
+#else
+    int ret = 0;
+
+    down_write(&mm->mmap_sem);
+    if(!inc) {
+        mm->locked_vm -= min(npages, mm->locked_vm);
+    } else if(mm->locked_vm+npages > rlimit(RLIMIT_MEMLOCK)>>PAGE_SHIFT
+              && !capable(CAP_IPC_LOCK)) {
+        ret = -ENOMEM;
+    } else {
+        mm->locked_vm += npages;
+    }
+    up_write(&mm->mmap_sem);
+    return ret;
+#endif
+}
+
+static
+void pico_ubuf_put_pages(struct pico_ubuf *ubuf, unsigned npages, bool dirty)
+{
+    unsigned i;
+
+#if LINUX_VERSION_CODE>=KERNEL_VERSION(5,6,0)
+    if(ubuf->longterm) {
+        unpin_user_pages_dirty_lock(ubuf->pages, npages, dirty);
+        return;
+    }
+#endif
+    for(i=0; i<npages; i++) {
+        if(dirty)
+            set_page_dirty_lock(ubuf->pages[i]);
+        put_page(ubuf->pages[i]);
+    }
+}
+
+struct pico_ubuf *pico_ubuf_pin(struct board_data *board, unsigned long addr, size_t len,
+                                int longterm)
+{
+    struct pico_ubuf *ubuf;
+    unsigned long first = addr>>PAGE_SHIFT,
+                  last = (addr+len-1)>>PAGE_SHIFT;
+    int ret, npinned;
+
+    if(!len || addr+len<addr)
+        return ERR_PTR(-EINVAL);
+
+    ubuf = kzalloc(sizeof(*ubuf), GFP_KERNEL);
+    if(!ubuf)
+        return ERR_PTR(-ENOMEM);
+
+    ubuf->addr = addr;
+    ubuf->len = len;
+    ubuf->npages = last-first+1;
+    ubuf->longterm = longterm;
+
+    if(longterm) {
+        /* pinned for as long as the FD is open, so counts as mlock()'d */
+        ret = pico_ubuf_account(current->mm, ubuf->npages, true);
+        if(ret)
+            goto freeubuf;
+        ubuf->mm = current->mm;
+        mmgrab(ubuf->mm);
+    }
+
+    /* may be large, so not kmalloc() */
+    ubuf->pages = vzalloc(ubuf->npages*sizeof(*ubuf->pages));
+    ret = -ENOMEM;
+    if(!ubuf->pages)
+        goto unaccount;
+
+#if LINUX_VERSION_CODE>=KERNEL_VERSION(5,6,0)
+    /* long-term pins move pages out of CMA/ZONE_MOVABLE,
+     * and are copied, not COW shared, by fork()
+     */
+    if(longterm)
+        npinned = pin_user_pages_fast(addr&PAGE_MASK, ubuf->npages,
+                                      FOLL_WRITE|FOLL_LONGTERM, ubuf->pages);
+    else
+#endif
+    /* 1 is write=1 for older kernels, and FOLL_WRITE for newer */
+    npinned = get_user_pages_fast(addr&PAGE_MASK, ubuf->npages, 1, ubuf->pages);
+    if(npinned<0) {
+        ret = npinned;
+        npinned = 0;
+        goto unpin;
+    } else if(npinned!=ubuf->npages) {
+        ret = -EFAULT;
+        goto unpin;
+    }
+
+    ret = sg_alloc_table_from_pages(&ubuf->sgt, ubuf->pages, ubuf->npages,
+                                    addr&~PAGE_MASK, len, GFP_KERNEL);
+    if(ret)
+        goto unpin;
+
+    ubuf->nents = dma_map_sg(&board->pci_dev->dev, ubuf->sgt.sgl, ubuf->sgt.orig_nents,
+                             DMA_FROM_DEVICE);
+    ret = -EIO;
+    if(!ubuf->nents)
+        goto freesg;
+
+    dev_dbg(&board->pci_dev->dev, "pinned %lx len %zu, %u pages, %d segments\n",
+            addr, len, ubuf->npages, ubuf->nents);
+
+    return ubuf;
+freesg:
+    sg_free_table(&ubuf->sgt);
+unpin:
+    pico_ubuf_put_pages(ubuf, npinned, false);
+    vfree(ubuf->pages);
+unaccount:
+    if(ubuf->mm) {
+        pico_ubuf_account(ubuf->mm, ubuf->npages, false);
+        mmdrop(ubuf->mm);
+    }
+freeubuf:
+    kfree(ubuf);
+    return ERR_PTR(ret);
+}
+
+void pico_ubuf_unpin(struct board_data *board, struct pico_ubuf *ubuf)
+{
+    dma_unmap_sg(&board->pci_dev->dev, ubuf->sgt.sgl, ubuf->sgt.orig_nents,
+                 DMA_FROM_DEVICE);
+    sg_free_table(&ubuf->sgt);
+
+    pico_ubuf_put_pages(ubuf, ubuf->npages, true);
+    vfree(ubuf->pages);
+
+    /* may be called from close() after the process has exited */
+    if(ubuf->mm) {
+        pico_ubuf_account(ubuf->mm, ubuf->npages, false);
+        mmdrop(ubuf->mm);
+    }
+    kfree(ubuf);
+}
+
+void pico_ubuf_sync_for_cpu(struct board_data *board, struct pico_ubuf *ubuf)
+{
+    dma_sync_sg_for_cpu(&board->pci_dev->dev, ubuf->sgt.sgl, ubuf->sgt.orig_nents,
+                        DMA_FROM_DEVICE);
+}
+
+void pico_ubuf_sync_for_device(struct board_data *board, struct pico_ubuf *ubuf)
+{
+    dma_sync_sg_for_device(&board->pci_dev->dev, ubuf->sgt.sgl, ubuf->sgt.orig_nents,
+                           DMA_FROM_DEVICE);
+}
@@ -0,0 +1,82 @@
+/*
+ * AMC-Pico8 Linux Driver
+ *
+ *  Copyright 2016 Board of Trustees of Michigan State University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License v2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ * \brief Pinned user buffers for direct DMA
+ */
+
+#ifndef AMC_PICO_UBUF_H_
+#define AMC_PICO_UBUF_H_
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+
+#include "amc_pico_internal.h"
+
+/**
+ * \struct pico_ubuf
+ *
+ * A user buffer with pages pinned and mapped for DMA_FROM_DEVICE.
+ */
+struct pico_ubuf {
+    /** user virtual address and length */
+    unsigned long addr;
+    size_t len;
+
+    unsigned npages;
+    struct page **pages;
+    /** pinned with FOLL_LONGTERM where available */
+    int longterm;
+    /** charged to this mm's RLIMIT_MEMLOCK when longterm, or NULL */
+    struct mm_struct *mm;
+
+    struct sg_table sgt;
+    /** number of mapped DMA segments in sgt */
+    int nents;
+};
+
+/**
+ * \brief Pin and DMA map a user buffer
+ * \param board    amc_pico board_data
+ * \param addr     user virtual address
+ * \param len      length in bytes
+ * \param longterm non-zero if pinned beyond the current syscall (MAP_USER_BUF).
+ *                 Charged to RLIMIT_MEMLOCK.
+ * \return pinned buffer, or ERR_PTR()
+ */
+struct pico_ubuf *pico_ubuf_pin(struct board_data *board, unsigned long addr, size_t len,
+                                int longterm);
+
+/**
+ * \brief Unmap and release a buffer from pico_ubuf_pin()
+ * \param board    amc_pico board_data
+ * \param ubuf     buffer to release
+ *
+ * Pages are marked dirty as the device may have written to them.
+ */
+void pico_ubuf_unpin(struct board_data *board, struct pico_ubuf *ubuf);
+
+/** \brief Make device writes visible to the CPU */
+void pico_ubuf_sync_for_cpu(struct board_data *board, struct pico_ubuf *ubuf);
+
+/** \brief Hand buffer back to the device before the next DMA */
+void pico_ubuf_sync_for_device(struct board_data *board, struct pico_ubuf *ubuf);
+
+#endif /* AMC_PICO_UBUF_H_ */
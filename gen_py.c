@@ -9,6 +9,8 @@
 int main(int argc, char *argv[])
 {
     struct trg_ctrl trg;
+    struct pico_dma_buf dbuf;
+    struct pico_frib_event fevt;
     FILE *out = stdout;
 
     if(argc>1) {
@@ -39,6 +41,42 @@ int main(int argc, char *argv[])
     EMIT(GET_SITE_ID);
     EMIT(GET_SITE_VERSION);
     EMIT(SET_SITE_MODE);
+    EMIT(FRIB_SITE_MODE_EVENTS);
+    EMIT(READ_MODE_ONESHOT);
+    EMIT(READ_MODE_STREAM);
+    EMIT(READ_MODE_DIRECT);
+    EMIT(READ_MODE_SHARED);
+    EMIT(GET_SHARED_INFO);
+    EMIT(PICO_STATUS_MMAP_OFFSET);
+    EMIT(PICO_READ_HEADER_MAGIC);
+    EMIT(SET_READ_HEADER);
+    EMIT(SET_READ_MODE);
+    EMIT(GET_STREAM_OVERRUNS);
+    EMIT(GET_DMA_BUF_INFO);
+    EMIT(DMA_DQBUF);
+    EMIT(DMA_QBUF);
+    EMIT(ARM_READ);
+    EMIT(MAP_USER_BUF);
+    EMIT(UNMAP_USER_BUF);
+    EMIT(GET_STATS);
+    EMIT(DDR_LOCK_PAGE);
+    EMIT(DDR_UNLOCK_PAGE);
+    EMIT(PICO_REG_READ);
+    EMIT(PICO_REG_WRITE);
+    EMIT(PICO_REG_RMW);
+    EMIT(PICO_REG_POLL);
+    EMIT(PICO_REG_BATCH_MAX);
+    EMIT(FRIB_REG_BATCH);
+    EMIT(RESYNC_REGS);
+    EMIT(PICO_ACQ_CONFIG_VERSION);
+    EMIT(PICO_CFG_RANGE);
+    EMIT(PICO_CFG_FSAMP);
+    EMIT(PICO_CFG_TRG);
+    EMIT(PICO_CFG_RING_BUF);
+    EMIT(PICO_CFG_GATE_MUX);
+    EMIT(PICO_CFG_CONV_MUX);
+    EMIT(PICO_CFG_ALL);
+    EMIT(SET_ACQ_CONFIG);
 #undef EMIT
 
     fprintf(out,
@@ -69,5 +107,135 @@ int main(int argc, char *argv[])
     fprintf(out, "assert trg_ctrl.mode.offset==%lu\n", offsetof(struct trg_ctrl, mode));
     fprintf(out, "assert trg_ctrl.mode.size==%lu\n", sizeof(trg.mode));
 
+    fprintf(out,
+            "class pico_dma_buf(ctypes.Structure):\n"
+            "    _fields_ = (('index', ctypes.c_uint32),\n"
+            "               ('offset', ctypes.c_uint32),\n"
+            "               ('length', ctypes.c_uint32),\n"
+            "               ('seq', ctypes.c_uint32),\n"
+            "              )\n"
+            );
+
+    fprintf(out, "assert pico_dma_buf.index.offset==%lu\n", offsetof(struct pico_dma_buf, index));
+    fprintf(out, "assert pico_dma_buf.offset.offset==%lu\n", offsetof(struct pico_dma_buf, offset));
+    fprintf(out, "assert pico_dma_buf.length.offset==%lu\n", offsetof(struct pico_dma_buf, length));
+    fprintf(out, "assert pico_dma_buf.seq.offset==%lu\n", offsetof(struct pico_dma_buf, seq));
+    fprintf(out, "assert ctypes.sizeof(pico_dma_buf)==%lu\n", sizeof(dbuf));
+
+    fprintf(out,
+            "class pico_stats(ctypes.Structure):\n"
+            "    _fields_ = (('bytes', ctypes.c_uint64),\n"
+            "               ('reads', ctypes.c_uint64),\n"
+            "               ('aborts', ctypes.c_uint64),\n"
+            "               ('cancelled', ctypes.c_uint64),\n"
+            "               ('fifo_runaway', ctypes.c_uint64),\n"
+            "               ('empty_done', ctypes.c_uint64),\n"
+            "               ('short_xfer', ctypes.c_uint64),\n"
+            "              )\n"
+            );
+
+    fprintf(out,
+            "class pico_status(ctypes.Structure):\n"
+            "    _fields_ = (('seq', ctypes.c_uint32),\n"
+            "               ('dma_done', ctypes.c_uint32),\n"
+            "               ('done_ns', ctypes.c_uint64),\n"
+            "               ('bytes_trans', ctypes.c_uint32),\n"
+            "               ('num_isr', ctypes.c_uint32),\n"
+            "               ('last_isr', ctypes.c_uint64),\n"
+            "               ('longest_isr', ctypes.c_uint64),\n"
+            "               ('aborts', ctypes.c_uint64),\n"
+            "               ('fifo_runaway', ctypes.c_uint64),\n"
+            "               ('empty_done', ctypes.c_uint64),\n"
+            "               ('short_xfer', ctypes.c_uint64),\n"
+            "               ('acq_seq', ctypes.c_uint64),\n"
+            "              )\n"
+            );
+
+    fprintf(out, "assert pico_status.short_xfer.offset==%lu\n", offsetof(struct pico_status, short_xfer));
+    fprintf(out, "assert pico_status.acq_seq.offset==%lu\n", offsetof(struct pico_status, acq_seq));
+    fprintf(out, "assert ctypes.sizeof(pico_status)==%lu\n", sizeof(struct pico_status));
+
+    fprintf(out,
+            "class pico_shared_info(ctypes.Structure):\n"
+            "    _fields_ = (('seq', ctypes.c_uint32),\n"
+            "               ('missed', ctypes.c_uint32),\n"
+            "              )\n"
+            );
+
+    fprintf(out, "assert ctypes.sizeof(pico_shared_info)==%lu\n", sizeof(struct pico_shared_info));
+
+    fprintf(out,
+            "class pico_acq_config(ctypes.Structure):\n"
+            "    _fields_ = (('version', ctypes.c_uint32),\n"
+            "               ('mask', ctypes.c_uint32),\n"
+            "               ('range', ctypes.c_uint32),\n"
+            "               ('fsamp', ctypes.c_uint32),\n"
+            "               ('trg_limit', ctypes.c_float),\n"
+            "               ('trg_nr_samp', ctypes.c_uint32),\n"
+            "               ('trg_ch_sel', ctypes.c_uint32),\n"
+            "               ('trg_mode', ctypes.c_uint32),\n"
+            "               ('ring_buf', ctypes.c_uint32),\n"
+            "               ('gate_mux', ctypes.c_uint32),\n"
+            "               ('conv_mux', ctypes.c_uint32),\n"
+            "               ('reserved', ctypes.c_uint32),\n"
+            "              )\n"
+            );
+
+    fprintf(out, "assert pico_acq_config.conv_mux.offset==%lu\n", offsetof(struct pico_acq_config, conv_mux));
+    fprintf(out, "assert ctypes.sizeof(pico_acq_config)==%lu\n", sizeof(struct pico_acq_config));
+
+    fprintf(out,
+            "class pico_read_header(ctypes.Structure):\n"
+            "    _fields_ = (('magic', ctypes.c_uint32),\n"
+            "               ('size', ctypes.c_uint32),\n"
+            "               ('seq', ctypes.c_uint64),\n"
+            "               ('arm_ns', ctypes.c_uint64),\n"
+            "               ('done_ns', ctypes.c_uint64),\n"
+            "               ('bytes', ctypes.c_uint32),\n"
+            "               ('reserved', ctypes.c_uint32),\n"
+            "               ('config', pico_acq_config),\n"
+            "              )\n"
+            );
+
+    fprintf(out, "assert pico_read_header.config.offset==%lu\n", offsetof(struct pico_read_header, config));
+    fprintf(out, "assert ctypes.sizeof(pico_read_header)==%lu\n", sizeof(struct pico_read_header));
+
+    fprintf(out, "assert pico_stats.short_xfer.offset==%lu\n", offsetof(struct pico_stats, short_xfer));
+    fprintf(out, "assert ctypes.sizeof(pico_stats)==%lu\n", sizeof(struct pico_stats));
+
+    fprintf(out,
+            "class pico_frib_event(ctypes.Structure):\n"
+            "    _fields_ = (('seq', ctypes.c_uint32),\n"
+            "               ('lost', ctypes.c_uint32),\n"
+            "               ('status', ctypes.c_uint32),\n"
+            "               ('length', ctypes.c_uint32),\n"
+            "              )\n"
+            );
+
+    fprintf(out, "assert pico_frib_event.seq.offset==%lu\n", offsetof(struct pico_frib_event, seq));
+    fprintf(out, "assert pico_frib_event.lost.offset==%lu\n", offsetof(struct pico_frib_event, lost));
+    fprintf(out, "assert pico_frib_event.status.offset==%lu\n", offsetof(struct pico_frib_event, status));
+    fprintf(out, "assert pico_frib_event.length.offset==%lu\n", offsetof(struct pico_frib_event, length));
+    fprintf(out, "assert ctypes.sizeof(pico_frib_event)==%lu\n", sizeof(fevt));
+
+    fprintf(out,
+            "class pico_reg_op(ctypes.Structure):\n"
+            "    _fields_ = (('offset', ctypes.c_uint32),\n"
+            "               ('op', ctypes.c_uint32),\n"
+            "               ('mask', ctypes.c_uint32),\n"
+            "               ('value', ctypes.c_uint32),\n"
+            "              )\n"
+            "class pico_reg_batch(ctypes.Structure):\n"
+            "    _fields_ = (('ops', ctypes.c_uint64),\n"
+            "               ('count', ctypes.c_uint32),\n"
+            "               ('timeout_us', ctypes.c_uint32),\n"
+            "              )\n"
+            );
+
+    fprintf(out, "assert pico_reg_op.value.offset==%lu\n", offsetof(struct pico_reg_op, value));
+    fprintf(out, "assert ctypes.sizeof(pico_reg_op)==%lu\n", sizeof(struct pico_reg_op));
+    fprintf(out, "assert pico_reg_batch.timeout_us.offset==%lu\n", offsetof(struct pico_reg_batch, timeout_us));
+    fprintf(out, "assert ctypes.sizeof(pico_reg_batch)==%lu\n", sizeof(struct pico_reg_batch));
+
     return 0;
 }
@@ -0,0 +1,121 @@
+#! /usr/bin/env python3
+# -*- coding: utf8 -*-
+
+''' Measures read (and optionally write) throughput of the DDR char. dev.
+
+Runs once with word at a time transfers (ddr_burst=0) and once with
+burst transfers (ddr_burst=1), and reports both, eg.
+
+  ./ddr_speed.py /dev/amc_pico_0000:03:00.0_ddr
+
+Changing ddr_burst needs write access to
+/sys/module/amc_pico/parameters/ddr_burst.  Otherwise only the current
+setting is measured.
+'''
+
+import argparse
+import os
+import time
+
+BURST_PARAM = '/sys/module/amc_pico/parameters/ddr_burst'
+
+
+def measure(fd, size, block, write, data=None):
+    ''' Returns (seconds, data read) '''
+    os.lseek(fd, 0, os.SEEK_SET)
+    chunks = []
+    t0 = time.monotonic()
+    pos = 0
+    while pos < size:
+        n = min(block, size - pos)
+        if write:
+            ret = os.write(fd, data[pos:pos + n])
+        else:
+            buf = os.read(fd, n)
+            chunks.append(buf)
+            ret = len(buf)
+        if ret == 0:
+            break
+        pos += ret
+    return time.monotonic() - t0, b''.join(chunks)
+
+
+def set_burst(val):
+    with open(BURST_PARAM, 'w') as F:
+        F.write('%d\n' % val)
+
+
+def run(device, size, block, write):
+    ''' Returns (read MB/s, write MB/s or None), or None on readback mismatch '''
+    wr = None
+    fd = os.open(device, os.O_RDWR if write else os.O_RDONLY)
+    try:
+        dt, data = measure(fd, size, block, False)
+        rd = len(data) / dt / 1e6
+        print('read  %d bytes in %.3f s : %.1f MB/s' % (len(data), dt, rd))
+
+        if write:
+            # restore the original contents while measuring
+            dt, _ = measure(fd, len(data), block, True, data)
+            wr = len(data) / dt / 1e6
+            print('write %d bytes in %.3f s : %.1f MB/s' % (len(data), dt, wr))
+
+            _, check = measure(fd, len(data), block, False)
+            if check != data:
+                print('Readback mismatch!')
+                return None
+    finally:
+        os.close(fd)
+    return rd, wr
+
+
+def main():
+    parser = argparse.ArgumentParser(description='DDR char. dev. throughput')
+    parser.add_argument('device', help='eg. /dev/amc_pico_0000:03:00.0_ddr')
+    parser.add_argument('-s', '--size', type=int, default=16,
+                        help='MB to transfer (default 16)')
+    parser.add_argument('-b', '--block', type=int, default=1024,
+                        help='KB per read()/write() call (default 1024)')
+    parser.add_argument('-w', '--write', action='store_true',
+                        help='Also measure writing back the data read')
+    args = parser.parse_args()
+
+    size = args.size * 1024 * 1024
+    block = args.block * 1024
+
+    try:
+        with open(BURST_PARAM) as F:
+            orig = int(F.read())
+    except IOError:
+        orig = None
+    if orig is not None and os.access(BURST_PARAM, os.W_OK):
+        modes = [0, 1]
+    else:
+        print('Can not change %s, measuring current setting only' % BURST_PARAM)
+        modes = [orig]
+
+    results = []
+    try:
+        for burst in modes:
+            if len(modes) > 1:
+                set_burst(burst)
+            ret = run(args.device, size, block, args.write)
+            if ret is None:
+                return 1
+            results.append((burst, ret))
+    finally:
+        if orig is not None and len(modes) > 1:
+            set_burst(orig)
+
+    print('%-10s %12s %12s' % ('ddr_burst', 'read MB/s', 'write MB/s'))
+    for burst, (rd, wr) in results:
+        print('%-10s %12.1f %12s' % (burst, rd, '%.1f' % wr if wr is not None else '-'))
+    if len(results) == 2 and results[0][1][0] > 0:
+        print('burst read speedup x%.1f' % (results[1][1][0] / results[0][1][0]))
+        if args.write and results[0][1][1] > 0:
+            print('burst write speedup x%.1f' % (results[1][1][1] / results[0][1][1]))
+    return 0
+
+
+if __name__ == '__main__':
+    exit(main())
@@ -4,8 +4,14 @@
 ''' Tests AMC-Pico8 driver functionality '''
 
 import argparse
+import ctypes
+import errno
 import fcntl
+import mmap
+import select
 import struct
+import threading
+import time
 import numpy as np
 import os
 
@@ -17,6 +23,7 @@ class PicoTest(object):
     def __init__(self, filename, debug=True):
         super(PicoTest, self).__init__()
         self.debug = debug
+        self.filename = filename
         self.f = os.open(filename, os.O_RDWR)
 
         if self.debug:
@@ -107,6 +114,399 @@ class PicoTest(object):
         buf = struct.pack('I', sel)
         fcntl.ioctl(self.f, picodefs.SET_CONV_MUX, buf)
 
+    def set_read_mode(self, mode):
+        ''' Selects one-shot or streaming read() '''
+        if self.debug:
+            print('set_read_mode(', str(mode), ')')
+
+        buf = struct.pack('I', mode)
+        fcntl.ioctl(self.f, picodefs.SET_READ_MODE, buf)
+
+    def get_stream_overruns(self):
+        ''' Gets number of times the stream stalled '''
+        buf = fcntl.ioctl(self.f, picodefs.GET_STREAM_OVERRUNS, '    ')
+        nover = struct.unpack('I', buf)[0]
+        if self.debug:
+            print('get_stream_overruns():', str(nover))
+        return nover
+
+    def read_stream(self, nr_samp):
+        ''' Reads nr_samp samples from a stream, which may take several read()s '''
+        if self.debug:
+            print('read_stream(', str(nr_samp), ')')
+
+        want = nr_samp*8*4
+        buf = bytes()
+        while len(buf) < want:
+            buf += os.read(self.f, want-len(buf))
+        return buf
+
+    def check_counter(self, buf, first=None):
+        ''' Checks data from a simulated board, which counts up one per word.
+            Returns the next expected value
+        '''
+        words = np.frombuffer(buf, dtype='<u4')
+        if first is None:
+            first = int(words[0])
+        expect = (first + np.arange(len(words), dtype=np.uint64)) & 0xffffffff
+        bad = np.nonzero(words != expect)[0]
+        if len(bad):
+            raise RuntimeError('data break at word %d, %08x expected %08x'
+                               % (bad[0], words[bad[0]], expect[bad[0]]))
+        return (first + len(words)) & 0xffffffff
+
+    def test_sim(self):
+        ''' Checks one-shot and stream data from a simulated board '''
+        self.set_fsamp(1e6)
+
+        self.check_counter(os.read(self.f, 100000*8*4))
+
+        self.set_read_mode(picodefs.READ_MODE_STREAM)
+        nover = self.get_stream_overruns()
+        nxt = None
+        for i in range(10):
+            buf = self.read_stream(100000)
+            if self.get_stream_overruns() != nover:
+                # a gap is expected
+                nover = self.get_stream_overruns()
+                nxt = None
+            nxt = self.check_counter(buf, nxt)
+        self.set_read_mode(picodefs.READ_MODE_ONESHOT)
+
+    def abort(self):
+        ''' Interrupts a read() in progress '''
+        if self.debug:
+            print('abort()')
+        fcntl.ioctl(self.f, picodefs.ABORT_READ)
+
+    def expect_cancel(self, func, delay=0.2):
+        ''' Calls func() in a thread, and ABORT_READ after delay.
+            func() must fail with ECANCELED
+        '''
+        result = []
+
+        def run():
+            try:
+                while True:
+                    func()
+            except OSError as e:
+                result.append(e.errno)
+
+        T = threading.Thread(target=run)
+        T.start()
+        time.sleep(delay)
+        self.abort()
+        T.join(2.0)
+        if T.is_alive() or result != [errno.ECANCELED]:
+            raise RuntimeError('ABORT_READ not seen %s' % result)
+
+    def test_sim_abort(self):
+        ''' ABORT_READ stops a running stream '''
+        self.set_fsamp(1e6)
+        self.set_read_mode(picodefs.READ_MODE_STREAM)
+        self.expect_cancel(lambda: os.read(self.f, 64*1024))
+        self.set_read_mode(picodefs.READ_MODE_ONESHOT)
+
+    def get_dma_buf_info(self):
+        ''' Gets the number and size of the DMA buffers '''
+        buf = fcntl.ioctl(self.f, picodefs.GET_DMA_BUF_INFO, bytes(8))
+        count, length = struct.unpack('II', buf)
+        if self.debug:
+            print('get_dma_buf_info():', count, length)
+        return count, length
+
+    def set_nonblock(self, nonblock):
+        ''' Sets or clears O_NONBLOCK '''
+        flags = fcntl.fcntl(self.f, fcntl.F_GETFL)
+        if nonblock:
+            flags |= os.O_NONBLOCK
+        else:
+            flags &= ~os.O_NONBLOCK
+        fcntl.fcntl(self.f, fcntl.F_SETFL, flags)
+
+    def expect_errno(self, err, func, *args):
+        ''' func(*args) must fail with errno err '''
+        try:
+            func(*args)
+        except OSError as e:
+            if e.errno != err:
+                raise
+        else:
+            raise RuntimeError('%s did not fail with %s' % (func, errno.errorcode[err]))
+
+    def get_stats(self):
+        ''' Gets cumulative counters '''
+        stats = picodefs.pico_stats()
+        fcntl.ioctl(self.f, picodefs.GET_STATS, stats)
+        return stats
+
+    def get_status(self, page):
+        ''' Gets a consistent copy of the mmap()'d status page '''
+        size = ctypes.sizeof(picodefs.pico_status)
+        while True:
+            seq = struct.unpack_from('I', page)[0]
+            if seq & 1:
+                continue # being updated
+            status = picodefs.pico_status.from_buffer_copy(page[:size])
+            if status.seq == seq == struct.unpack_from('I', page)[0]:
+                return status
+
+    def sysfs_path(self, name):
+        ''' Path of a sysfs attribute of this device '''
+        rdev = os.fstat(self.f).st_rdev
+        return '/sys/dev/char/%d:%d/device/%s' % (os.major(rdev), os.minor(rdev), name)
+
+    def test_sim_dqbuf(self):
+        ''' DMA_DQBUF/DMA_QBUF of mmap()'d stream buffers '''
+        count, length = self.get_dma_buf_info()
+        bufs = [mmap.mmap(self.f, length, mmap.MAP_SHARED, mmap.PROT_READ, offset=i*length)
+                for i in range(count)]
+
+        self.set_fsamp(1e6)
+        self.set_read_mode(picodefs.READ_MODE_STREAM)
+        nover = self.get_stream_overruns()
+        nxt = None
+        for i in range(2*count):
+            b = picodefs.pico_dma_buf()
+            fcntl.ioctl(self.f, picodefs.DMA_DQBUF, b)
+            if self.get_stream_overruns() != nover:
+                nover = self.get_stream_overruns()
+                nxt = None
+            nxt = self.check_counter(bufs[b.index][b.offset:b.offset+b.length], nxt)
+            fcntl.ioctl(self.f, picodefs.DMA_QBUF, struct.pack('I', b.index))
+
+        # hold every buffer
+        held = []
+        for i in range(count):
+            b = picodefs.pico_dma_buf()
+            fcntl.ioctl(self.f, picodefs.DMA_DQBUF, b)
+            held.append(b.index)
+        self.expect_errno(errno.ENOBUFS, fcntl.ioctl, self.f, picodefs.DMA_DQBUF,
+                          picodefs.pico_dma_buf())
+        self.expect_errno(errno.EBUSY, os.read, self.f, length)
+        for idx in held:
+            fcntl.ioctl(self.f, picodefs.DMA_QBUF, struct.pack('I', idx))
+
+        self.set_read_mode(picodefs.READ_MODE_ONESHOT)
+        for b in bufs:
+            b.close()
+
+    def test_sim_nonblock(self):
+        ''' ARM_READ, poll() and O_NONBLOCK read() '''
+        count, length = self.get_dma_buf_info()
+        self.set_fsamp(1e6)
+
+        self.set_nonblock(True)
+        try:
+            fcntl.ioctl(self.f, picodefs.ARM_READ, struct.pack('I', length))
+            # a full buffer takes >100 ms at 1 MHz
+            self.expect_errno(errno.EAGAIN, os.read, self.f, length)
+
+            P = select.poll()
+            P.register(self.f, select.POLLIN)
+            deadline = time.time() + 5.0
+            # short timeout for irqmode=0
+            while not P.poll(1):
+                if time.time() > deadline:
+                    raise RuntimeError('ARM_READ never completed')
+            buf = os.read(self.f, 2*length)
+            if len(buf) != length:
+                raise RuntimeError('read() %d bytes after ARM_READ of %d' % (len(buf), length))
+            self.check_counter(buf)
+        finally:
+            self.set_nonblock(False)
+
+    def test_sim_direct(self):
+        ''' READ_MODE_DIRECT, with and without MAP_USER_BUF '''
+        count, length = self.get_dma_buf_info()
+        size = 2*count*length # larger than the DMA buffers
+        self.set_fsamp(1e6)
+
+        m = mmap.mmap(-1, size)
+        self.set_read_mode(picodefs.READ_MODE_DIRECT)
+        try:
+            # pinned for each read()
+            if os.readv(self.f, [m]) != size:
+                raise RuntimeError('short direct read()')
+            self.check_counter(m)
+
+            ref = ctypes.c_char.from_buffer(m)
+            ubuf = struct.pack('QQ', ctypes.addressof(ref), size)
+            del ref
+            fcntl.ioctl(self.f, picodefs.MAP_USER_BUF, ubuf)
+            try:
+                # a sub-range of the mapped buffer
+                view = memoryview(m)[length:length+length//2]
+                if os.readv(self.f, [view]) != len(view):
+                    raise RuntimeError('short direct read()')
+                self.check_counter(view)
+                view.release()
+            finally:
+                fcntl.ioctl(self.f, picodefs.UNMAP_USER_BUF)
+        finally:
+            self.set_read_mode(picodefs.READ_MODE_ONESHOT)
+        m.close()
+
+    def test_sim_ring(self):
+        ''' One-shot read() larger than all of the DMA buffers '''
+        count, length = self.get_dma_buf_info()
+        self.set_fsamp(1e6)
+
+        try:
+            buf = os.read(self.f, 2*count*length + length//2)
+        except OSError as e:
+            if e.errno != errno.EOVERFLOW:
+                raise
+            # the copy fell behind, which must not leave a gap in the data
+            print('ring read() overrun, retrying')
+            buf = os.read(self.f, 2*count*length + length//2)
+        if len(buf) != 2*count*length + length//2:
+            raise RuntimeError('short ring read() %d' % len(buf))
+        self.check_counter(buf)
+
+    def test_sim_shared(self):
+        ''' READ_MODE_SHARED readers receive the same acquisition '''
+        self.set_fsamp(1e6)
+        other = PicoTest(self.filename, debug=self.debug)
+        self.set_read_mode(picodefs.READ_MODE_SHARED)
+        other.set_read_mode(picodefs.READ_MODE_SHARED)
+
+        try:
+            a = os.read(self.f, 1000*8*4)
+            b = os.read(other.f, 1000*8*4)
+            if a != b:
+                raise RuntimeError('shared readers see different data')
+            self.check_counter(a)
+
+            infos = []
+            for t in (self, other):
+                buf = fcntl.ioctl(t.f, picodefs.GET_SHARED_INFO, bytes(8))
+                infos.append(picodefs.pico_shared_info.from_buffer_copy(buf))
+            if infos[0].seq != infos[1].seq:
+                raise RuntimeError('shared readers at %d and %d' % (infos[0].seq, infos[1].seq))
+
+            # SET_READ_MODE fails while a read() on this FD waits
+            count, length = self.get_dma_buf_info()
+            self.set_fsamp(150e3) # several seconds to fill the buffers
+            result = []
+
+            def run():
+                try:
+                    os.read(self.f, count*length)
+                except OSError as e:
+                    result.append(e.errno)
+
+            T = threading.Thread(target=run)
+            T.start()
+            time.sleep(0.2)
+            self.expect_errno(errno.EBUSY, self.set_read_mode, picodefs.READ_MODE_ONESHOT)
+            self.abort()
+            T.join(2.0)
+            if T.is_alive() or result != [errno.ECANCELED]:
+                raise RuntimeError('ABORT_READ not seen %s' % result)
+        finally:
+            other.set_read_mode(picodefs.READ_MODE_ONESHOT)
+            self.set_read_mode(picodefs.READ_MODE_ONESHOT)
+            del other
+
+    def test_sim_header(self):
+        ''' SET_READ_HEADER, and the status page '''
+        hsize = ctypes.sizeof(picodefs.pico_read_header)
+        page = mmap.mmap(self.f, mmap.PAGESIZE, mmap.MAP_SHARED, mmap.PROT_READ,
+                         offset=picodefs.PICO_STATUS_MMAP_OFFSET)
+        self.set_fsamp(1e6)
+        fsamp = self.get_fsamp()
+        before = self.get_status(page)
+
+        fcntl.ioctl(self.f, picodefs.SET_READ_HEADER, struct.pack('I', 1))
+        try:
+            seq = None
+            for i in range(2):
+                buf = os.read(self.f, hsize + 1000*8*4)
+                hdr = picodefs.pico_read_header.from_buffer_copy(buf[:hsize])
+                if hdr.magic != picodefs.PICO_READ_HEADER_MAGIC or hdr.size != hsize:
+                    raise RuntimeError('bad header %08x %d' % (hdr.magic, hdr.size))
+                if hdr.bytes != len(buf)-hsize or hdr.bytes != 1000*8*4:
+                    raise RuntimeError('header bytes %d, read %d' % (hdr.bytes, len(buf)-hsize))
+                if hdr.done_ns < hdr.arm_ns or hdr.config.fsamp != fsamp:
+                    raise RuntimeError('bad header times or config')
+                if seq is not None and hdr.seq != seq+1:
+                    raise RuntimeError('header seq %d after %d' % (hdr.seq, seq))
+                seq = hdr.seq
+                self.check_counter(buf[hsize:])
+        finally:
+            fcntl.ioctl(self.f, picodefs.SET_READ_HEADER, struct.pack('I', 0))
+
+        after = self.get_status(page)
+        if after.acq_seq != seq or after.dma_done-before.dma_done < 2:
+            raise RuntimeError('status page acq_seq %d dma_done %d, expected %d'
+                               % (after.acq_seq, after.dma_done, seq))
+        page.close()
+
+    def test_sim_acq_config(self):
+        ''' SET_ACQ_CONFIG changes, and reads back, the settings '''
+        cfg = picodefs.pico_acq_config(version=picodefs.PICO_ACQ_CONFIG_VERSION,
+                                       mask=picodefs.PICO_CFG_FSAMP|picodefs.PICO_CFG_RANGE,
+                                       fsamp=500000, range=0b1010)
+        fcntl.ioctl(self.f, picodefs.SET_ACQ_CONFIG, cfg)
+        if cfg.fsamp != self.get_fsamp() or cfg.range != self.get_range():
+            raise RuntimeError('SET_ACQ_CONFIG not applied')
+
+        # mask==0 only reads
+        cfg = picodefs.pico_acq_config(version=picodefs.PICO_ACQ_CONFIG_VERSION)
+        fcntl.ioctl(self.f, picodefs.SET_ACQ_CONFIG, cfg)
+        if cfg.range != 0b1010:
+            raise RuntimeError('SET_ACQ_CONFIG read back range %x' % cfg.range)
+
+        cfg = picodefs.pico_acq_config(version=picodefs.PICO_ACQ_CONFIG_VERSION+1)
+        self.expect_errno(errno.EINVAL, fcntl.ioctl, self.f, picodefs.SET_ACQ_CONFIG, cfg)
+
+        self.set_range(0)
+        self.set_fsamp(1e6)
+
+    def test_sim_reg_batch(self):
+        ''' FRIB_REG_BATCH, needs sim_frib=1 '''
+        buf = fcntl.ioctl(self.f, picodefs.GET_SITE_ID, bytes(4))
+        if struct.unpack('I', buf)[0] != picodefs.USER_SITE_FRIB:
+            print('FRIB_REG_BATCH not tested, load with sim_frib=1')
+            return
+
+        scratch = 0x30100 # FRIB_CAP_FIRST, ordinary memory when simulated
+        ops = (picodefs.pico_reg_op*5)(
+            (scratch, picodefs.PICO_REG_WRITE, 0, 0x12345678),
+            (scratch, picodefs.PICO_REG_RMW, 0x0000ffff, 0xabcd),
+            (scratch, picodefs.PICO_REG_READ, 0, 0),
+            (scratch, picodefs.PICO_REG_POLL, 0xffff0000, 0x12340000),
+            (scratch, picodefs.PICO_REG_POLL, 0xffffffff, 0), # times out
+        )
+        batch = picodefs.pico_reg_batch(ctypes.addressof(ops), 5, 1000)
+
+        fcntl.ioctl(self.f, picodefs.SET_SITE_MODE, struct.pack('I', 1))
+        try:
+            self.expect_errno(errno.ETIMEDOUT, fcntl.ioctl, self.f, picodefs.FRIB_REG_BATCH, batch)
+        finally:
+            fcntl.ioctl(self.f, picodefs.SET_SITE_MODE, struct.pack('I', 0))
+
+        if [op.value for op in ops] != [0x12345678, 0x1234abcd, 0x1234abcd, 0x1234abcd, 0x1234abcd]:
+            raise RuntimeError('FRIB_REG_BATCH results %s' % [hex(op.value) for op in ops])
+
+    def test_sim_stats(self):
+        ''' GET_STATS and the timing histograms count a read() '''
+        for name in ('hist_isr', 'hist_copy'):
+            with open(self.sysfs_path(name), 'w') as F:
+                F.write('0')
+        before = self.get_stats()
+        self.set_fsamp(1e6)
+        os.read(self.f, 1000*8*4)
+        after = self.get_stats()
+        if after.reads != before.reads+1 or after.bytes-before.bytes < 1000*8*4:
+            raise RuntimeError('GET_STATS reads %d -> %d, bytes %d -> %d'
+                               % (before.reads, after.reads, before.bytes, after.bytes))
+        for name in ('hist_isr', 'hist_copy'):
+            with open(self.sysfs_path(name)) as F:
+                if not F.read().strip():
+                    raise RuntimeError('%s empty after read()' % name)
+
     def read(self, nr_samp, print_data=True):
         ''' Reads picoammeter data'''
         if self.debug:
@@ -127,10 +527,26 @@ def main():
 
     parser = argparse.ArgumentParser(description='Performs tests on AMC-Pico8 driver')
     parser.add_argument('--filename', dest='file', action='store')
+    parser.add_argument('--sim', action='store_true',
+                        help='Check data from a simulated board')
 
     args = parser.parse_args()
 
     pico_test = PicoTest(args.file)
+
+    if args.sim:
+        pico_test.test_sim()
+        pico_test.test_sim_abort()
+        pico_test.test_sim_dqbuf()
+        pico_test.test_sim_nonblock()
+        pico_test.test_sim_direct()
+        pico_test.test_sim_ring()
+        pico_test.test_sim_shared()
+        pico_test.test_sim_header()
+        pico_test.test_sim_acq_config()
+        pico_test.test_sim_reg_batch()
+        pico_test.test_sim_stats()
+
     pico_test.get_range()
     pico_test.set_range(0b1110000)
     pico_test.get_range()
@@ -150,6 +566,12 @@ def main():
     pico_test.read(10)
     pico_test.read(100000)
 
+    pico_test.set_read_mode(picodefs.READ_MODE_STREAM)
+    for i in range(10):
+        pico_test.read_stream(100000)
+    pico_test.get_stream_overruns()
+    pico_test.set_read_mode(picodefs.READ_MODE_ONESHOT)
+
     pico_test.set_conv_mux(0)
     [pico_test.set_gate_mux(i) for i in range(8)]
 